@@ -5,6 +5,20 @@
 #include <sstream>
 #include <sys/wait.h>
 #include <iomanip>
+#include <fstream>
+#include <climits>
+#include <cmath>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 #include "Commands.h"
 
 using namespace std;
@@ -77,9 +91,596 @@ void _removeBackgroundSign(char *cmd_line) {
     cmd_line[str.find_last_not_of(WHITESPACE, idx) + 1] = 0;
 }
 
+#define SPAWN_CLONE_STACK_SIZE (64 * 1024)
+
+// What limit's options map to, in the order of ResourceLimits::values.
+static const struct {
+    char option;
+    const char *name;
+    __rlimit_resource resource;
+    bool isSize;    // printed and parsed with K, M and G
+} limit_kinds[LIMITS_NUM] = {
+    {'m', "mem", RLIMIT_AS, true},
+    {'t', "cpu", RLIMIT_CPU, false},
+    {'n', "files", RLIMIT_NOFILE, false},
+    {'c', "core", RLIMIT_CORE, true}
+};
+
+ResourceLimits ResourceLimits::over(const ResourceLimits& base) const {
+    ResourceLimits merged = base;
+    for (int kind = 0; kind < LIMITS_NUM; kind++) {
+        if (has(kind)) merged.values[kind] = values[kind];
+    }
+    merged.set |= set;
+    return merged;
+}
+
+bool ResourceLimits::apply() const {
+    for (int kind = 0; kind < LIMITS_NUM; kind++) {
+        struct rlimit limit;
+        if (!has(kind)) continue;
+        if (getrlimit(limit_kinds[kind].resource, &limit) == -1) return false;
+        limit.rlim_cur = values[kind];
+        if (setrlimit(limit_kinds[kind].resource, &limit) == -1) return false;
+    }
+    return true;
+}
+
+SchedSettings SchedSettings::over(const SchedSettings& base) const {
+    SchedSettings merged = base;
+    if (hasCpus) {
+        merged.cpus = cpus;
+        merged.hasCpus = true;
+    }
+    if (policy != -1) merged.policy = policy;
+    if (hasNice) {
+        merged.nice = nice;
+        merged.hasNice = true;
+    }
+    return merged;
+}
+
+bool SchedSettings::apply(pid_t tid) const {
+    if (hasCpus && sched_setaffinity(tid, sizeof(cpus), &cpus) == -1) return false;
+    if (policy != -1) {
+        struct sched_param param;
+        param.sched_priority = 0;
+        if (sched_setscheduler(tid, policy, &param) == -1) return false;
+    }
+    // For a single thread on Linux, tid 0 included.
+    return !hasNice || setpriority(PRIO_PROCESS, tid, nice) == 0;
+}
+
+static string _formatLimit(int kind, rlim_t value) {
+    if (value == RLIM_INFINITY) return "unlimited";
+    const char *units = "KMG";
+    int unit = -1;
+    while (limit_kinds[kind].isSize && unit < 2 && value != 0 && value % 1024 == 0) {
+        value /= 1024;
+        unit++;
+    }
+    return to_string((unsigned long long) value) + (unit >= 0 ? string(1, units[unit]) : "");
+}
+
+string ResourceLimits::str() const {
+    string out;
+    for (int kind = 0; kind < LIMITS_NUM; kind++) {
+        if (!has(kind)) continue;
+        if (!out.empty()) out += " ";
+        out += string(limit_kinds[kind].name) + " " + _formatLimit(kind, values[kind]);
+    }
+    return out;
+}
+
+struct SpawnChildArgs {
+    const char *file;
+    char *const *argv;
+    const SpawnAttrs *attrs;
+    sigset_t child_mask;
+    volatile int exec_errno;
+    int err_pipe;
+};
+
+// Body of the child for the vfork/clone/fork strategies. It may share memory with
+// the parent, so it only issues syscalls: no allocation, no stdio, no exceptions.
+static int _spawnChild(void *arg) {
+    SpawnChildArgs *args = (SpawnChildArgs *) arg;
+    struct sigaction dfl;
+    memset(&dfl, 0, sizeof(dfl));
+    dfl.sa_handler = SIG_DFL;
+    for (int sig = 1; sig < NSIG; sig++) {
+        struct sigaction curr;
+        if (sigaction(sig, nullptr, &curr) == 0 && !(curr.sa_flags & SA_SIGINFO) &&
+            (curr.sa_handler == SIG_DFL || curr.sa_handler == SIG_IGN)) {
+            continue;
+        }
+        sigaction(sig, &dfl, nullptr);
+    }
+    const SpawnAttrs *attrs = args->attrs;
+    if (attrs->pgid >= 0 && setpgid(0, attrs->pgid) == -1) {
+        goto fail;
+    }
+    if (!attrs->limits.apply() || !attrs->sched.apply(0)) {
+        goto fail;
+    }
+    for (size_t i = 0; i < attrs->dups.size(); i++) {
+        if (attrs->dups[i].first != attrs->dups[i].second &&
+            dup2(attrs->dups[i].first, attrs->dups[i].second) == -1) {
+            goto fail;
+        }
+    }
+    for (size_t i = 0; i < attrs->closes.size(); i++) {
+        close(attrs->closes[i]);
+    }
+    sigprocmask(SIG_SETMASK, &args->child_mask, nullptr);
+    if (strchr(args->file, '/') != nullptr) {
+        execve(args->file, args->argv, environ);
+    } else {
+        execvp(args->file, args->argv);
+    }
+fail:
+    args->exec_errno = errno;
+    if (args->err_pipe != -1) {
+        int err = errno;
+        ssize_t ignored = write(args->err_pipe, &err, sizeof(err));
+        (void) ignored;
+    }
+    _exit(127);
+}
+
+static pid_t _posixSpawn(const char *file, char *const argv[], const SpawnAttrs &attrs) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t spawn_attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&spawn_attr);
+
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    posix_spawnattr_setsigmask(&spawn_attr, &empty_mask);
+    if (attrs.pgid >= 0) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&spawn_attr, attrs.pgid);
+    }
+    posix_spawnattr_setflags(&spawn_attr, flags);
+    for (const pair<int, int> &dup : attrs.dups) {
+        posix_spawn_file_actions_adddup2(&actions, dup.first, dup.second);
+    }
+    for (int fd : attrs.closes) {
+        posix_spawn_file_actions_addclose(&actions, fd);
+    }
+
+    pid_t pid;
+    int res;
+    if (strchr(file, '/') != nullptr) {
+        res = posix_spawn(&pid, file, &actions, &spawn_attr, argv, environ);
+    } else {
+        res = posix_spawnp(&pid, file, &actions, &spawn_attr, argv, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&spawn_attr);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    return pid;
+}
+
+pid_t spawnProcess(const char *file, char *const argv[], const SpawnAttrs &attrs, SpawnStrategy strategy) {
+    // posix_spawn has no attribute for resource limits, affinity or nice.
+    if (strategy == SPAWN_POSIX && (attrs.limits.set != 0 || attrs.sched.isSet())) strategy = SPAWN_VFORK;
+    if (strategy == SPAWN_POSIX) {
+        return _posixSpawn(file, argv, attrs);
+    }
+
+    SpawnChildArgs args;
+    args.file = file;
+    args.argv = argv;
+    args.attrs = &attrs;
+    args.exec_errno = 0;
+    args.err_pipe = -1;
+    sigemptyset(&args.child_mask);
+
+    // No handler of smash may run in a child that shares its memory.
+    sigset_t all_signals, old_mask;
+    sigfillset(&all_signals);
+    sigprocmask(SIG_BLOCK, &all_signals, &old_mask);
+
+    void *stack = MAP_FAILED;
+    if (strategy == SPAWN_CLONE) {
+        stack = mmap(nullptr, SPAWN_CLONE_STACK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (stack == MAP_FAILED) strategy = SPAWN_FORK;
+    }
+
+    int err_pipe[2] = {-1, -1};
+    if (strategy == SPAWN_FORK && pipe2(err_pipe, O_CLOEXEC) == -1) {
+        int err = errno;
+        sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+        errno = err;
+        return -1;
+    }
+
+    pid_t pid;
+    if (strategy == SPAWN_VFORK) {
+        pid = vfork();
+        if (pid == 0) _spawnChild(&args);
+    } else if (strategy == SPAWN_CLONE) {
+        pid = clone(_spawnChild, (char *) stack + SPAWN_CLONE_STACK_SIZE,
+                    CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+    } else {
+        pid = fork();
+        if (pid == 0) {
+            close(err_pipe[0]);
+            args.err_pipe = err_pipe[1];
+            _spawnChild(&args);
+        }
+    }
+    int err = errno;
+
+    if (strategy == SPAWN_FORK) {
+        close(err_pipe[1]);
+        int child_errno;
+        if (pid > 0 && read(err_pipe[0], &child_errno, sizeof(child_errno)) == sizeof(child_errno)) {
+            args.exec_errno = child_errno;
+        }
+        close(err_pipe[0]);
+    }
+    if (stack != MAP_FAILED) munmap(stack, SPAWN_CLONE_STACK_SIZE);
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+
+    if (pid == -1) {
+        errno = err;
+        return -1;
+    }
+    if (args.exec_errno != 0) {
+        waitpid(pid, nullptr, 0);
+        errno = args.exec_errno;
+        return -1;
+    }
+    return pid;
+}
+
+pid_t forkCommand(Command *cmd, const SpawnAttrs &attrs) {
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("smash error: fork failed");
+        return -1;
+    }
+    if (pid == 0) {
+        if (attrs.pgid >= 0) setpgid(0, attrs.pgid);
+        for (const pair<int, int> &dup : attrs.dups) {
+            if (dup2(dup.first, dup.second) == -1) {
+                perror("smash error: dup2 failed");
+                exit(1);
+            }
+            if (dup.second == STDIN_FILENO) SmallShell::getInstance().resetInput();
+        }
+        for (int fd : attrs.closes) {
+            close(fd);
+        }
+        SmallShell& smallShell = SmallShell::getInstance();
+        if (!smallShell.spawnLimits().over(attrs.limits).apply()) {
+            perror("smash error: setrlimit failed");
+            exit(1);
+        }
+        if (!smallShell.getCommandSched().over(attrs.sched).apply(0)) {
+            perror("smash error: sched failed");
+            exit(1);
+        }
+        cmd->execute();
+        cout.flush();
+        exit(0);
+    }
+    // Both sides set the group so a following stage can already join it.
+    if (attrs.pgid >= 0) setpgid(pid, attrs.pgid == 0 ? pid : attrs.pgid);
+    return pid;
+}
+
+const char *spawnStrategyName(SpawnStrategy strategy) {
+    switch (strategy) {
+        case SPAWN_POSIX: return "posix_spawn";
+        case SPAWN_VFORK: return "vfork";
+        case SPAWN_CLONE: return "clone";
+        case SPAWN_FORK: return "fork";
+    }
+    return "unknown";
+}
+
+#define PATH_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+                         IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+PathCache::PathCache() : cacheable(false), negatives_cacheable(false), hits(0), misses(0) {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    const char *path = getenv("PATH");
+    path_env = path == nullptr ? "" : path;
+    rebuild();
+}
+
+PathCache::~PathCache() {
+    if (inotify_fd != -1) close(inotify_fd);
+}
+
+// Starts over: forgets every entry and watches the directories of the current PATH.
+void PathCache::rebuild() {
+    entries.clear();
+    if (inotify_fd != -1) {
+        close(inotify_fd);
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    cacheable = inotify_fd != -1;
+    negatives_cacheable = cacheable;
+
+    istringstream dirs(path_env);
+    string dir;
+    while (getline(dirs, dir, ':')) {
+        if (dir.empty() || dir[0] != '/') {
+            cacheable = false;
+            continue;
+        }
+        if (cacheable && inotify_add_watch(inotify_fd, dir.c_str(), PATH_WATCH_MASK) == -1) {
+            negatives_cacheable = false;
+        }
+    }
+}
+
+// Drops the names that changed in a PATH directory since the last lookup.
+void PathCache::processEvents() {
+    if (inotify_fd == -1) return;
+    char buffer[MAX_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *ptr = buffer; ptr < buffer + len;) {
+            struct inotify_event *event = (struct inotify_event *) ptr;
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_Q_OVERFLOW)) {
+                rebuild();
+                return;
+            }
+            if (event->len > 0) entries.erase(event->name);
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+string PathCache::search(const string& path_env, const string& name) {
+    istringstream dirs(path_env);
+    string dir;
+    while (getline(dirs, dir, ':')) {
+        string path = (dir.empty() ? "." : dir) + "/" + name;
+        struct stat path_stat;
+        if (stat(path.c_str(), &path_stat) == 0 && S_ISREG(path_stat.st_mode) && access(path.c_str(), X_OK) == 0) {
+            return path;
+        }
+    }
+    return "";
+}
+
+string PathCache::resolve(const string& name) {
+    const char *path = getenv("PATH");
+    if (path_env != (path == nullptr ? "" : path)) {
+        path_env = path == nullptr ? "" : path;
+        rebuild();
+    }
+    if (!cacheable) {
+        misses++;
+        return search(path_env, name);
+    }
+    processEvents();
+
+    auto it = entries.find(name);
+    if (it != entries.end()) {
+        hits++;
+        it->second.hits++;
+        return it->second.path;
+    }
+    misses++;
+    string found = search(path_env, name);
+    if (!found.empty() || negatives_cacheable) {
+        Entry entry = {found, 0};
+        entries[name] = entry;
+    }
+    return found;
+}
+
+void PathCache::clear() {
+    entries.clear();
+    hits = 0;
+    misses = 0;
+}
+
+void PathCache::print() const {
+    vector<string> names;
+    for (const auto& entry : entries) {
+        names.push_back(entry.first);
+    }
+    sort(names.begin(), names.end());
+    for (const string& name : names) {
+        const Entry& entry = entries.at(name);
+        if (entry.path.empty()) {
+            cout << name << ": not found (" << entry.hits << " hits)" << endl;
+        } else {
+            cout << name << "=" << entry.path << " (" << entry.hits << " hits)" << endl;
+        }
+    }
+    unsigned long lookups = hits + misses;
+    cout << "hits: " << hits << ", misses: " << misses << ", hit rate: "
+         << (lookups == 0 ? 0 : hits * 100 / lookups) << "%" << endl;
+}
+
+bool GlobExpander::hasWildcards(const string& word) {
+    return word.find_first_of("*?[") != string::npos;
+}
+
+// "a{b,c{d,e}}f" -> "abf", "acdf", "acef". Sets without a comma are left alone.
+vector<string> GlobExpander::expandBraces(const string& word) {
+    int depth = 0;
+    size_t open = string::npos;
+    vector<size_t> commas;
+    for (size_t i = 0; i < word.size(); i++) {
+        if (word[i] == '{') {
+            if (depth++ == 0) {
+                open = i;
+                commas.clear();
+            }
+        } else if (word[i] == ',' && depth == 1) {
+            commas.push_back(i);
+        } else if (word[i] == '}' && depth > 0 && --depth == 0) {
+            if (commas.empty()) continue;
+            string prefix = word.substr(0, open);
+            vector<string> tails = expandBraces(word.substr(i + 1));
+            vector<string> result;
+            commas.push_back(i);
+            size_t alt_start = open + 1;
+            for (size_t comma : commas) {
+                for (const string& alt : expandBraces(word.substr(alt_start, comma - alt_start))) {
+                    for (const string& tail : tails) {
+                        result.push_back(prefix + alt + tail);
+                    }
+                }
+                alt_start = comma + 1;
+            }
+            return result;
+        }
+    }
+    return vector<string>(1, word);
+}
+
+bool GlobExpander::match(const char *pattern, const char *name) {
+    const char *star_pattern = nullptr, *star_name = nullptr;
+    while (*name != '\0') {
+        if (*pattern == '*') {
+            star_pattern = ++pattern;
+            star_name = name;
+            continue;
+        }
+        bool matched = false;
+        const char *next = pattern + 1;
+        if (*pattern == '?') {
+            matched = true;
+        } else if (*pattern == '[') {
+            const char *ptr = pattern + 1;
+            bool negate = *ptr == '!' || *ptr == '^';
+            if (negate) ptr++;
+            bool in_set = false;
+            const char *set_start = ptr;
+            while (*ptr != '\0' && (*ptr != ']' || ptr == set_start)) {
+                if (ptr[1] == '-' && ptr[2] != ']' && ptr[2] != '\0') {
+                    if (*ptr <= *name && *name <= ptr[2]) in_set = true;
+                    ptr += 3;
+                } else {
+                    if (*ptr == *name) in_set = true;
+                    ptr++;
+                }
+            }
+            if (*ptr == ']') {
+                matched = in_set != negate;
+                next = ptr + 1;
+            } else {
+                matched = *name == '[';     // no closing bracket, a literal '['
+            }
+        } else {
+            matched = *pattern == *name;
+        }
+        if (matched) {
+            pattern = next;
+            name++;
+        } else if (star_pattern != nullptr) {
+            pattern = star_pattern;
+            name = ++star_name;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+const vector<GlobExpander::DirEntry>& GlobExpander::listDir(const string& dir) {
+    auto it = listings.find(dir);
+    if (it != listings.end()) return it->second;
+
+    vector<DirEntry>& entries = listings[dir];
+    DIR *dir_stream = opendir(dir.empty() ? "." : dir.c_str());
+    if (dir_stream == nullptr) return entries;
+    struct dirent *dir_member;
+    while ((dir_member = readdir(dir_stream)) != nullptr) {
+        if (strcmp(dir_member->d_name, ".") == 0 || strcmp(dir_member->d_name, "..") == 0) continue;
+        DirEntry entry = {dir_member->d_name, dir_member->d_type};
+        entries.push_back(entry);
+    }
+    closedir(dir_stream);
+    sort(entries.begin(), entries.end(), [](const DirEntry& a, const DirEntry& b) { return a.name < b.name; });
+    return entries;
+}
+
+bool GlobExpander::isDir(const string& dir, const DirEntry& entry) {
+    if (entry.type == DT_DIR) return true;
+    if (entry.type != DT_LNK && entry.type != DT_UNKNOWN) return false;
+    struct stat entry_stat;
+    return stat((dir + entry.name).c_str(), &entry_stat) == 0 && S_ISDIR(entry_stat.st_mode);
+}
+
+void GlobExpander::expandPath(const string& prefix, const vector<string>& components, size_t index,
+                              vector<string>& out) {
+    if (index == components.size()) {
+        struct stat path_stat;
+        if (lstat(prefix.c_str(), &path_stat) == 0) out.push_back(prefix);
+        return;
+    }
+    const string& component = components[index];
+    bool last = index + 1 == components.size();
+    if (!hasWildcards(component)) {
+        expandPath(prefix + component + (last ? "" : "/"), components, index + 1, out);
+        return;
+    }
+    for (const DirEntry& entry : listDir(prefix)) {
+        if (entry.name[0] == '.' && component[0] != '.') continue;
+        if (!match(component.c_str(), entry.name.c_str())) continue;
+        if (last) {
+            out.push_back(prefix + entry.name);
+        } else if (isDir(prefix, entry)) {
+            expandPath(prefix + entry.name + "/", components, index + 1, out);
+        }
+    }
+}
+
+void GlobExpander::expand(const string& word, vector<string>& out) {
+    for (const string& alternative : expandBraces(word)) {
+        if (!hasWildcards(alternative)) {
+            out.push_back(alternative);
+            continue;
+        }
+        vector<string> components;
+        istringstream path(alternative);
+        string component;
+        while (getline(path, component, '/')) {
+            if (!component.empty()) components.push_back(component);
+        }
+        size_t matches_start = out.size();
+        expandPath(alternative[0] == '/' ? "/" : "", components, 0, out);
+        if (alternative.back() == '/') {
+            // "dir*/" only matches directories and keeps the slash.
+            size_t kept = matches_start;
+            for (size_t i = matches_start; i < out.size(); i++) {
+                struct stat path_stat;
+                if (stat(out[i].c_str(), &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) out[kept++] = out[i] + "/";
+            }
+            out.resize(kept);
+        }
+        if (out.size() == matches_start) out.push_back(alternative);
+    }
+}
+
+// The shorter of two poll timeouts, -1 is forever.
+static int _soonerMs(int a_ms, int b_ms) {
+    return a_ms == -1 || (b_ms != -1 && b_ms < a_ms) ? b_ms : a_ms;
+}
+
 //
 //
-SmallShell::SmallShell() : job_list_of_shell(new JobsList()), lastPwd(nullptr), foreground_pid(-1) {}
+SmallShell::SmallShell() : job_list_of_shell(new JobsList()), lastPwd(nullptr), foreground_pid(-1),
+                           foreground_is_group(true), input_eof(false) {}
 
 
 SmallShell::~SmallShell() {
@@ -113,7 +714,7 @@ Command *SmallShell::CreateCommand(const char *cmd_line) {
         return new aliasCommand(real_command, alias_map, keys);
     } else if (firstWord.compare("unalias") == 0) {
         return new unaliasCommand(real_command, alias_map, keys);
-    } else if (cmd_line_str.find('>') != string::npos){
+    } else if (cmd_line_str.find_first_of("<>") != string::npos){
         return new RedirectionCommand(real_command);
     } else if (cmd_line_str.find('|') != string::npos){
         return new PipeCommand(real_command);
@@ -133,6 +734,30 @@ Command *SmallShell::CreateCommand(const char *cmd_line) {
         return new ListDirCommand(real_command);
     } else if (firstWord.compare("getuser") == 0) {
         return new GetUserCommand(real_command);
+    } else if (firstWord.compare("hash") == 0) {
+        return new HashCommand(real_command);
+    } else if (firstWord.compare("which") == 0) {
+        return new WhichCommand(real_command);
+    } else if (firstWord.compare("setopt") == 0) {
+        return new SetOptCommand(real_command);
+    } else if (firstWord.compare("pipestat") == 0) {
+        return new PipeStatCommand(real_command);
+    } else if (firstWord.compare("queue") == 0 || firstWord.compare("batch") == 0) {
+        return new QueueCommand(real_command, job_list_of_shell, firstWord.compare("batch") == 0);
+    } else if (firstWord.compare("jobstats") == 0) {
+        return new JobStatsCommand(real_command, job_list_of_shell);
+    } else if (firstWord.compare("parallel") == 0) {
+        return new ParallelCommand(real_command, job_list_of_shell);
+    } else if (firstWord.compare("rungraph") == 0) {
+        return new RunGraphCommand(real_command, job_list_of_shell);
+    } else if (firstWord.compare("sched") == 0 || firstWord.compare("pin") == 0) {
+        return new SchedCommand(real_command, job_list_of_shell, firstWord.compare("pin") == 0);
+    } else if (firstWord.compare("throttle") == 0) {
+        return new ThrottleCommand(real_command, job_list_of_shell);
+    } else if (firstWord.compare("limit") == 0) {
+        return new LimitCommand(real_command, job_list_of_shell);
+    } else if (firstWord.compare("wait") == 0) {
+        return new WaitCommand(real_command, job_list_of_shell);
     } else if (firstWord.compare("watch") == 0) {
         return new WatchCommand(real_command);
     } else {
@@ -141,156 +766,3144 @@ Command *SmallShell::CreateCommand(const char *cmd_line) {
 }
 
 void SmallShell::executeCommand(const char *cmd_line) {
+    job_list_of_shell->drainOutputs();
+    job_list_of_shell->reapChildren();
+    job_list_of_shell->startQueued();
     job_list_of_shell->removeFinishedJobs();
     Command* cmd = CreateCommand(cmd_line);
     setForegroundPid(-1);
     cmd->execute();
+    delete cmd;
+}
+
+bool SmallShell::readLine(string& line) {
+    cout.flush();   // as cin would, it is tied to cout
+    while (true) {
+        size_t end = input_buffer.find('\n');
+        if (end != string::npos) {
+            line = input_buffer.substr(0, end);
+            input_buffer.erase(0, end + 1);
+            return true;
+        }
+        if (input_eof) {
+            line = input_buffer;
+            input_buffer.clear();
+            return !line.empty();
+        }
+        vector<struct pollfd> polls = {{STDIN_FILENO, POLLIN, 0}, {job_list_of_shell->getChildFd(), POLLIN, 0},
+                                       {job_list_of_shell->getPressureFd(), POLLPRI, 0}};
+        job_list_of_shell->addOutputPolls(polls);
+        int ready = poll(polls.data(), polls.size(),
+                         _soonerMs(job_list_of_shell->queueRetryMs(),
+                                   _soonerMs(job_list_of_shell->memGuardRetryMs(), job_list_of_shell->throttleRetryMs())));
+        if (ready == -1) continue;     // Ctrl-C at the prompt
+        if (ready == 0) job_list_of_shell->startQueued();
+        job_list_of_shell->guardMemory(polls[2].revents != 0);
+        job_list_of_shell->throttleJobs();
+        if (polls.size() > 3) job_list_of_shell->drainOutputs();
+        if (polls[1].revents & POLLIN) {
+            job_list_of_shell->reapChildren();
+            job_list_of_shell->startQueued();
+        }
+        if (polls[0].revents != 0) {
+            char chunk[4096];
+            ssize_t len = read(STDIN_FILENO, chunk, sizeof(chunk));
+            if (len > 0) {
+                input_buffer.append(chunk, len);
+            } else if (len == 0 || (errno != EINTR && errno != EAGAIN)) {
+                input_eof = true;
+            }
+        }
+    }
+}
+
+void SmallShell::waitForeground(const vector<pid_t>& pids, vector<double> *cpu_secs) {
+    if (cpu_secs != nullptr) cpu_secs->assign(pids.size(), -1);
+    for (size_t i = 0; i < pids.size(); i++) {
+        int status;
+        struct rusage usage;
+        job_list_of_shell->waitGuarded(pids[i]);
+        if (wait4(pids[i], &status, WUNTRACED, &usage) == -1) {
+            perror("smash error: wait4 failed");
+        } else if (cpu_secs != nullptr && !WIFSTOPPED(status)) {
+            (*cpu_secs)[i] = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+                             + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+        }
+    }
+}
+
+void SmallShell::waitOrAddJob(Command *cmd, const vector<pid_t>& pids, vector<double> *cpu_secs) {
+    if (pids.empty()) return;
+    if (cmd->background()) {
+        job_list_of_shell->addJob(cmd, pids, false);
+        return;
+    }
+    setForegroundPid(pids.front());
+    waitForeground(pids, cpu_secs);
+    setForegroundPid(-1);
 }
 
 void JobsList::addJob(Command *cmd, int pid, bool isStopped) {
-    removeFinishedJobs();
-    int job_id = 1;
-    if (!jobs_list.empty()) job_id = jobs_list.back()->job_id + 1;
-    jobs_list.push_back(new JobEntry(job_id, pid, cmd, isStopped));
+    addJob(cmd, vector<pid_t>(1, pid), isStopped);
 }
 
-void JobsList::printJobsList() {
-    removeFinishedJobs();
+// Below this many removed jobs the table is not worth compacting.
+#define JOBS_TABLE_MIN_COMPACT 64
+
+static unsigned long long _nowNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
 
-    for (JobEntry* job : jobs_list) {
+JobOutput::JobOutput(int fd, size_t capacity)
+        : ring(capacity > 0 ? capacity : 1), ring_start(0), ring_used(0), spill_fd(-1), spilled(0), lost(0), fd(fd) {}
 
-        cout << "[" << job->job_id << "] " << job->command->aliased_command << endl;
-    }
+JobOutput::~JobOutput() {
+    if (fd != -1) close(fd);
+    if (spill_fd != -1) close(spill_fd);
 }
 
-void JobsList::killAllJobs() {
-    for (JobEntry* job : jobs_list) {
-        if (kill(job->job_pid, SIGKILL) != 0) perror("smash error: kill failed");
+void JobOutput::drain() {
+    char chunk[4096];
+    while (fd != -1) {
+        ssize_t len = read(fd, chunk, sizeof(chunk));
+        if (len > 0) {
+            append(chunk, len);
+        } else if (len == 0 || (errno != EINTR && errno != EAGAIN)) {
+            close(fd);
+            fd = -1;
+        } else if (errno == EAGAIN) {
+            return;
+        }
     }
-    jobs_list.clear();
 }
 
-void JobsList::removeFinishedJobs() {
-    auto it = jobs_list.begin();
-    while (it != jobs_list.end()) {
-        int end_status;
-        pid_t result = waitpid((*it)->job_pid, &end_status, WNOHANG);
-        if (result > 0) {
-            delete *it;
-            it = jobs_list.erase(it);
-        } 
-        else ++it;
+void JobOutput::spill(const char *data, size_t len) {
+    if (spill_fd == -1) {
+        const char *tmp_dir = getenv("TMPDIR");
+        string path = string(tmp_dir != nullptr ? tmp_dir : "/tmp") + "/smash-job-XXXXXX";
+        vector<char> name(path.begin(), path.end());
+        name.push_back('\0');
+        spill_fd = mkostemp(name.data(), O_CLOEXEC);
+        if (spill_fd == -1) perror("smash error: mkostemp failed");
+        if (spill_fd != -1) unlink(name.data());
+    }
+    // The file holds the bytes from lost to spilled, a failed write starts it over.
+    if (spill_fd != -1 && pwrite(spill_fd, data, len, spilled - lost) != (ssize_t) len) {
+        perror("smash error: pwrite failed");
+        close(spill_fd);
+        spill_fd = -1;
     }
+    spilled += len;
+    if (spill_fd == -1) lost = spilled;
 }
 
+void JobOutput::append(const char *data, size_t len) {
+    size_t capacity = ring.size();
+    if (ring_used + len > capacity) {
+        // Spill the oldest bytes, as many as the new data pushes out of the ring.
+        size_t from_ring = min(ring_used + len - capacity, ring_used);
+        while (from_ring > 0) {
+            size_t part = min(from_ring, capacity - ring_start);
+            spill(&ring[ring_start], part);
+            ring_start = (ring_start + part) % capacity;
+            ring_used -= part;
+            from_ring -= part;
+        }
+        if (len > capacity) {
+            spill(data, len - capacity);
+            data += len - capacity;
+            len = capacity;
+        }
+    }
+    for (size_t done = 0; done < len;) {
+        size_t end = (ring_start + ring_used) % capacity;
+        size_t part = min(len - done, capacity - end);
+        memcpy(&ring[end], data + done, part);
+        ring_used += part;
+        done += part;
+    }
+}
 
-JobsList::JobEntry *JobsList::getJobById(int jobId) {
-    for (JobEntry* job : jobs_list) {
-        if (job->job_id == jobId) return job;
+static void _writeAll(int out_fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(out_fd, data, len);
+        if (written == -1 && errno == EINTR) continue;
+        if (written <= 0) return;
+        data += written;
+        len -= written;
     }
-    return nullptr;
 }
 
-void JobsList::removeJobById(int jobId) {
-    auto it = jobs_list.begin();
-    while (it != jobs_list.end()) {
-        if ((*it)->job_id == jobId) {
-            delete *it;
-            jobs_list.erase(it);
-            return;
+unsigned long long JobOutput::writeTo(int out_fd, unsigned long long from) const {
+    cout.flush();
+    if (from < lost) from = lost;   // what never reached the spill file is gone
+    char chunk[4096];
+    while (from < spilled) {
+        ssize_t len = pread(spill_fd, chunk, min((unsigned long long) sizeof(chunk), spilled - from), from - lost);
+        if (len <= 0) {
+            from = spilled;
+            break;
         }
-        ++it;
+        _writeAll(out_fd, chunk, len);
+        from += len;
+    }
+    size_t capacity = ring.size();
+    for (size_t offset = from - spilled; offset < ring_used;) {
+        size_t start = (ring_start + offset) % capacity;
+        size_t part = min(ring_used - offset, capacity - start);
+        _writeAll(out_fd, &ring[start], part);
+        offset += part;
     }
+    return total();
 }
 
-void JobsList::removeJobByPid(int jobPid) {
-    auto it = jobs_list.begin();
-    while (it != jobs_list.end()) {
-        if ((*it)->job_pid == jobPid) {
-            delete *it;
-            jobs_list.erase(it);
-            return;
+void JobOutput::forward() {
+    if (fd == -1) return;
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("smash error: fork failed");
+        return;
+    }
+    if (pid == 0) {
+        // Ends with the job's output, Ctrl-C is for the job.
+        signal(SIGINT, SIG_IGN);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        char chunk[4096];
+        ssize_t len;
+        while ((len = read(fd, chunk, sizeof(chunk))) > 0 || (len == -1 && errno == EINTR)) {
+            if (len > 0) _writeAll(STDOUT_FILENO, chunk, len);
         }
-        ++it;
+        _exit(0);
+    }
+    close(fd);
+    fd = -1;
+}
+
+JobsList::JobsList() : live_num(0), child_fd(-1), queue_running(0), starting_id(-1), admission_blocked(false),
+                       shell_pid(getpid()), exits_sink(nullptr), pressure_fd(-1), pressure_polled(false),
+                       pressure_total(0), pressure_check_ns(0), pressure_ns(0), throttled_num(0) {
+    sigset_t child_mask;
+    sigemptyset(&child_mask);
+    sigaddset(&child_mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &child_mask, nullptr) == -1) return;
+    child_fd = signalfd(-1, &child_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (child_fd == -1) {
+        perror("smash error: signalfd failed");
+        sigprocmask(SIG_UNBLOCK, &child_mask, nullptr);
     }
 }
 
+void JobsList::addJob(Command *cmd, const vector<pid_t>& pids, bool isStopped) {
+    removeFinishedJobs();
+    auto starting = slot_by_id.find(starting_id);
+    starting_id = -1;
+    if (starting != slot_by_id.end()) {
+        // A queued job that just started keeps its id and its place in the table.
+        JobEntry& job = jobs_table[starting->second];
+        job.attach(pids);
+        job.isStopped = isStopped;
+        job.limits = SmallShell::getInstance().spawnLimits();
+        job.sched = SmallShell::getInstance().getCommandSched();
+        for (pid_t pid : pids) slot_by_pid[pid] = starting->second;
+        return;
+    }
+    // Removed jobs at the end are dropped right away, the last entry is a live job.
+    int job_id = jobs_table.empty() ? 1 : jobs_table.back().job_id + 1;
+    size_t removed_num = jobs_table.size() - live_num;
+    if (removed_num > JOBS_TABLE_MIN_COMPACT && removed_num > live_num) compact();
 
-JobsList::JobEntry *JobsList::getLastJob(int *lastJobId) {
-    *lastJobId = jobs_list.back()->job_id;
-    return jobs_list.back();
+    size_t slot = jobs_table.size();
+    jobs_table.emplace_back(job_id, pids, cmd, isStopped);
+    jobs_table.back().limits = SmallShell::getInstance().spawnLimits();
+    jobs_table.back().sched = SmallShell::getInstance().getCommandSched();
+    slot_by_id[job_id] = slot;
+    for (pid_t pid : pids) slot_by_pid[pid] = slot;
+    live_num++;
 }
 
-JobsList::JobEntry *JobsList::getLastStoppedJob(int *jobId) {
-    auto it = jobs_list.end() - 1;
-    while (it != jobs_list.begin()) {
-        if ((*it)->isStopped) {
-            *jobId = (*it)->job_id;
-            return *it;
+void JobsList::removeSlot(size_t slot) {
+    JobEntry& job = jobs_table[slot];
+    // What jobs -o shows for the id from now on, an older job's output is gone.
+    for (auto kept = finished_outputs.begin(); kept != finished_outputs.end(); ++kept) {
+        if (kept->first == job.job_id) {
+            finished_outputs.erase(kept);
+            break;
         }
     }
-    return nullptr;
+    if (job.output) {
+        finished_outputs.push_back(make_pair(job.job_id, std::move(job.output)));
+        if (finished_outputs.size() > FINISHED_OUTPUTS_MAX) finished_outputs.pop_front();
+    }
+    if (job.fromQueue && !job.pids.empty()) queue_running--;
+    if (job.throttle.percent != 0) throttled_num--;
+    for (pid_t pid : job.pids) slot_by_pid.erase(pid);
+    if (job.leader_pidfd != -1) close(job.leader_pidfd);
+    job.leader_pidfd = -1;
+    job.pids.clear();
+    job.closeProcFiles(-1);
+    slot_by_id.erase(job.job_id);
+    job.job_id = -1;
+    live_num--;
+    while (!jobs_table.empty() && jobs_table.back().job_id == -1) jobs_table.pop_back();
 }
 
-Command::Command(const char *cmd_line) : command_str(cmd_line), aliased_command(cmd_line) {
-    isBackground = _isBackgroundComamnd(cmd_line);
-    char* new_cmd = strdup(cmd_line);
-    if (isBackground) _removeBackgroundSign(new_cmd);
+void JobsList::compact() {
+    vector<JobEntry> live;
+    live.reserve(live_num);
+    for (JobEntry& job : jobs_table) {
+        if (job.job_id != -1) live.push_back(std::move(job));
+    }
+    jobs_table.swap(live);
+    slot_by_id.clear();
+    slot_by_pid.clear();
+    for (size_t slot = 0; slot < jobs_table.size(); slot++) {
+        slot_by_id[jobs_table[slot].job_id] = slot;
+        for (pid_t pid : jobs_table[slot].pids) slot_by_pid[pid] = slot;
+    }
+}
 
-    istringstream stream(new_cmd);
-    string word;
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1UL << 2)
+#endif
 
-    if (stream >> word) {
-        command_name = word;
-    }
-    while (stream >> word) {
-        command_args.push_back(word);
+// fd, or -1 once it is one of the last SPARE_FDS descriptors smash may open, those
+// are left to the commands. Whatever keeps an fd for a job also works without it.
+static int _keepFd(int fd) {
+    struct rlimit limit;
+    if (fd == -1 || getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY ||
+        (rlim_t) fd + SPARE_FDS < limit.rlim_cur) {
+        return fd;
     }
-        
-    free(new_cmd);
+    close(fd);
+    return -1;
+}
 
+static int _openPidfd(pid_t pid) {
+    return _keepFd((int) syscall(SYS_pidfd_open, pid, 0));
 }
 
-RedirectionCommand::RedirectionCommand(const char *cmd_line) : Command(cmd_line) {
-    isBackground = false;
-    char* copy = strdup(command_str.c_str());
-    _removeBackgroundSign(copy);
-    _trim(copy);
-    command_str = string(copy);
-    free(copy);
+JobsList::JobEntry::JobEntry(int job_id, const vector<pid_t>& pids, const Command* command, bool isStopped)
+        : job_id(job_id), leader_pidfd(-1), command_str(command->getCommandStr()),
+          aliased_command(command->aliased_command), isStopped(isStopped), isQueued(false), needsAdmission(false),
+          fromQueue(false), memStopped(false), exit_status(0) {
+    attach(pids);
+}
+
+JobsList::JobEntry::JobEntry(int job_id, const string& command_line, bool needsAdmission)
+        : job_id(job_id), job_pid(-1), leader_pidfd(-1), command_str(command_line + " &"), aliased_command(command_str),
+          isStopped(false), isQueued(true), needsAdmission(needsAdmission), fromQueue(false), memStopped(false),
+          status_pid(-1),
+          exit_status(0), start_ns(_nowNs()) {
+    time(&start_time);
+}
+
+void JobsList::JobEntry::attach(const vector<pid_t>& pids) {
+    job_pid = pids.front();
+    status_pid = pids.back();
+    this->pids = pids;
+    isQueued = false;
+    time(&start_time);
+    start_ns = _nowNs();
+    // The leader is not reaped before it becomes a job, its pid is not recycled yet. The
+    // other processes get a pidfd only while wait watches them.
+    leader_pidfd = _openPidfd(job_pid);
+}
+
+JobsList::JobEntry::JobEntry(JobEntry&& other) noexcept
+        : job_id(other.job_id), job_pid(other.job_pid), pids(std::move(other.pids)),
+          leader_pidfd(other.leader_pidfd), command_str(std::move(other.command_str)),
+          aliased_command(std::move(other.aliased_command)), isStopped(other.isStopped),
+          isQueued(other.isQueued), needsAdmission(other.needsAdmission), fromQueue(other.fromQueue),
+          memStopped(other.memStopped), status_pid(other.status_pid), exit_status(other.exit_status),
+          start_time(other.start_time), start_ns(other.start_ns), usage(other.usage), output(std::move(other.output)),
+          proc_files(std::move(other.proc_files)), limits(other.limits), sched(other.sched),
+          throttle(other.throttle) {
+    other.leader_pidfd = -1;
+    other.proc_files.clear();
+}
+
+JobsList::JobEntry::~JobEntry() {
+    if (leader_pidfd != -1) close(leader_pidfd);
+    closeProcFiles(-1);
+}
+
+void JobsList::JobEntry::closeProcFiles(pid_t pid) {
+    for (size_t i = proc_files.size(); i-- > 0;) {
+        if (pid != -1 && proc_files[i].pid != pid) continue;
+        if (proc_files[i].stat_fd != -1) close(proc_files[i].stat_fd);
+        if (proc_files[i].statm_fd != -1) close(proc_files[i].statm_fd);
+        proc_files.erase(proc_files.begin() + i);
+    }
+}
 
-    size_t pos_of_big_redir = command_str.find(">>");
-    if (pos_of_big_redir != string::npos) {
-        isAppend = true;
-        file_name = _trim(command_str.substr(pos_of_big_redir + 2));
-        command_name_in_redir = _trim(command_str.substr(0, pos_of_big_redir));
+void JobsList::reapChildren() {
+    if (child_fd != -1) {
+        // SIGCHLDs that arrive together are merged, one is enough to drain them all.
+        struct signalfd_siginfo info[16];
+        bool exited = false;
+        while (read(child_fd, info, sizeof(info)) > 0) exited = true;
+        if (!exited) return;
     }
-    else {
-        pos_of_big_redir = command_str.find('>');
-        isAppend = false;
-        file_name = _trim(command_str.substr(pos_of_big_redir + 1));
-        command_name_in_redir = _trim(command_str.substr(0, pos_of_big_redir));
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        processExited(pid, status, &usage);
     }
 }
 
-PipeCommand::PipeCommand(const char *cmd_line) : Command(cmd_line) {
-    char* copy = strdup(command_str.c_str());
-    _removeBackgroundSign(copy);
-    _trim(copy);
-    command_str = string(copy);
-    free(copy);    size_t pos_of_pipe_err = command_str.find("|&");
-    if (pos_of_pipe_err != string::npos) {
-        isErr = true;
-        command_name_1 = _trim(command_str.substr(0, pos_of_pipe_err));
-        command_name_2 = _trim(command_str.substr(pos_of_pipe_err+2));
+void JobsList::processExited(pid_t pid, int status, const struct rusage *usage) {
+    auto found = slot_by_pid.find(pid);
+    if (found == slot_by_pid.end()) return;
+    JobEntry& job = jobs_table[found->second];
+    size_t i = std::find(job.pids.begin(), job.pids.end(), pid) - job.pids.begin();
+    if (pid == job.job_pid && job.leader_pidfd != -1) {
+        close(job.leader_pidfd);
+        job.leader_pidfd = -1;
+    }
+    job.pids.erase(job.pids.begin() + i);
+    job.closeProcFiles(pid);
+    if (pid == job.status_pid) {
+        job.exit_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    }
+    if (usage != nullptr) job.usage.add(*usage);
+    if (job.pids.empty()) {
+        recordFinished(job);
+        finished_ids.push_back(job.job_id);
+        if (job.fromQueue) queue_running--;
+        if (exits_sink != nullptr) exits_sink->push_back(make_pair(job.job_id, job.exit_status));
+    }
+    slot_by_pid.erase(found);
+}
+
+void JobUsage::add(const struct rusage& usage) {
+    user_secs += usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    sys_secs += usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    max_rss_kb = max(max_rss_kb, usage.ru_maxrss);
+    minor_faults += usage.ru_minflt;
+    major_faults += usage.ru_majflt;
+    voluntary_switches += usage.ru_nvcsw;
+    involuntary_switches += usage.ru_nivcsw;
+}
+
+void CommandStats::add(const JobUsage& usage) {
+    count++;
+    total_secs += usage.wall_secs;
+    peak_rss_kb = max(peak_rss_kb, usage.max_rss_kb);
+    if (wall_secs.size() < JOB_STATS_SAMPLES) {
+        wall_secs.push_back(usage.wall_secs);
+    } else {
+        wall_secs[next_sample] = usage.wall_secs;
+        next_sample = (next_sample + 1) % JOB_STATS_SAMPLES;
+    }
+}
+
+double CommandStats::percentile(double p) const {
+    vector<double> sorted(wall_secs);
+    sort(sorted.begin(), sorted.end());
+    size_t rank = (size_t) ceil(p / 100 * sorted.size());
+    return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+void JobsList::recordFinished(JobEntry& job) {
+    job.usage.wall_secs = (_nowNs() - job.start_ns) / 1e9;
+    JobRecord record;
+    record.job_id = job.job_id;
+    record.aliased_command = job.aliased_command;
+    record.exit_status = job.exit_status;
+    record.usage = job.usage;
+    record.limits = job.limits;
+    finished_records.push_back(record);
+    if (finished_records.size() > JOB_RECORDS_MAX) finished_records.pop_front();
+
+    size_t start = job.command_str.find_first_not_of(WHITESPACE);
+    size_t end = start == string::npos ? start : job.command_str.find_first_of(WHITESPACE + "&", start);
+    command_stats[start == string::npos ? "" : job.command_str.substr(start, end - start)].add(job.usage);
+}
+
+int JobsList::signalJob(JobEntry *job, int sig) {
+    if (job->isQueued) {
+        if (sig == SIGSTOP || sig == SIGTSTP) {
+            job->isStopped = true;
+        } else if (sig == SIGCONT) {
+            job->isStopped = false;
+            startQueued();
+        } else {
+            removeJobById(job->job_id);
+        }
+        return 0;
+    }
+    if (sig == SIGSTOP || sig == SIGTSTP) {
+        job->isStopped = true;
+    } else if (sig == SIGCONT) {
+        job->isStopped = false;
+        job->memStopped = false;    // resumed by hand, memguard has no say anymore
     }
-    else {
-        pos_of_pipe_err = command_str.find('|');
-        isErr = false;
-        command_name_1 = _trim(command_str.substr(0, pos_of_pipe_err));
-        command_name_2 = _trim(command_str.substr(pos_of_pipe_err+1));
+    return signalGroup(job, sig);
+}
+
+int JobsList::signalGroup(JobEntry *job, int sig) {
+    if (job->leader_pidfd != -1) {
+        if (syscall(SYS_pidfd_send_signal, job->leader_pidfd, sig, nullptr, PIDFD_SIGNAL_PROCESS_GROUP) == 0) {
+            return 0;
+        }
+        // A kernel without group signals through a pidfd, or a leader that exited
+        // while the rest of the group runs on. An unreaped pid is not recycled.
+        if (errno != EINVAL && errno != ENOSYS && errno != ESRCH) return -1;
     }
+    return killpg(job->job_pid, sig);
+}
+
+void JobsList::printJobsList() {
+    removeFinishedJobs();
+
+    for (JobEntry& job : *this) {
 
+        cout << "[" << job.job_id << "] " << job.aliased_command;
+        if (job.isQueued) cout << (job.isStopped ? " (queued, stopped)" : " (queued)");
+        if (job.memStopped) cout << " (stopped by memguard)";
+        if (job.throttle.percent != 0) cout << " (throttled to " << job.throttle.percent << "%)";
+        cout << endl;
+    }
+}
+
+void JobsList::printJobsVerbose() {
+    removeFinishedJobs();
+    unsigned long long now = _nowNs();
+    cout << fixed << setprecision(3);
+    for (JobEntry& job : *this) {
+        cout << "[" << job.job_id << "] " << job.aliased_command << ": ";
+        if (job.isQueued) {
+            cout << (job.isStopped ? "queued, stopped" : "queued") << endl;
+        } else {
+            cout << "running for " << (now - job.start_ns) / 1e9 << " secs";
+            if (job.limits.set != 0) cout << ", limits " << job.limits.str();
+            const JobThrottle& throttle = job.throttle;
+            if (throttle.percent != 0) {
+                cout << ", throttled to " << throttle.percent << "%";
+                if (throttle.cycle_ns != 0) {
+                    cout << setprecision(1) << ", runs " << throttle.run_ns / 1e6 << " of every "
+                         << throttle.period_ns / 1e6 << " ms" << setprecision(3);
+                }
+            }
+            cout << endl;
+        }
+    }
+    for (const JobRecord& record : finished_records) {
+        const JobUsage& usage = record.usage;
+        cout << "[" << record.job_id << "] " << record.aliased_command << ": exit " << record.exit_status
+             << " after " << usage.wall_secs << " secs, user " << usage.user_secs << " secs, sys "
+             << usage.sys_secs << " secs, max rss " << usage.max_rss_kb << " KiB, faults "
+             << usage.minor_faults << " minor " << usage.major_faults << " major, switches "
+             << usage.voluntary_switches << " voluntary " << usage.involuntary_switches << " involuntary";
+        if (record.limits.set != 0) cout << ", limits " << record.limits.str();
+        cout << endl;
+    }
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+}
+
+static const long ticks_per_sec = sysconf(_SC_CLK_TCK);
+
+// utime + stime of a process from its stat file, false once it is gone.
+static bool _readTicks(int stat_fd, unsigned long long *ticks) {
+    char buffer[512];
+    ssize_t len = pread(stat_fd, buffer, sizeof(buffer) - 1, 0);
+    if (len <= 0) return false;
+    buffer[len] = '\0';
+    // The name in parentheses may hold anything, the fields start after the last ')'.
+    char *fields = strrchr(buffer, ')');
+    unsigned long long utime, stime;
+    if (fields == nullptr || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                                    &utime, &stime) != 2) {
+        return false;
+    }
+    *ticks = utime + stime;
+    return true;
+}
+
+// Adds the share of a CPU process used since its last sample to cpu_share, returns
+// its resident size in KiB, -1 once it is gone.
+static long _sampleProcess(ProcFiles& process, unsigned long long now_ns, unsigned long long since_ns,
+                           double *cpu_share) {
+    static const long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    char buffer[512];
+    unsigned long long ticks;
+    if (!_readTicks(process.stat_fd, &ticks)) return -1;
+    unsigned long long from_ns = process.sampled_ns != 0 ? process.sampled_ns : since_ns;
+    unsigned long long from_ticks = process.sampled_ns != 0 ? process.ticks : 0;
+    if (now_ns > from_ns) *cpu_share += (double) (ticks - from_ticks) / ticks_per_sec / ((now_ns - from_ns) / 1e9);
+    process.ticks = ticks;
+    process.sampled_ns = now_ns;
+
+    long size_pages, resident_pages;
+    ssize_t len = pread(process.statm_fd, buffer, sizeof(buffer) - 1, 0);
+    if (len <= 0) return 0;
+    buffer[len] = '\0';
+    if (sscanf(buffer, "%ld %ld", &size_pages, &resident_pages) != 2) return 0;
+    return resident_pages * page_kb;
+}
+
+// The /proc files of pid, a process of job, opened the first time.
+static ProcFiles& _procFiles(JobsList::JobEntry& job, pid_t pid) {
+    auto process = find_if(job.proc_files.begin(), job.proc_files.end(),
+                           [pid](const ProcFiles& files) { return files.pid == pid; });
+    if (process != job.proc_files.end()) return *process;
+    // Not reaped yet, so the pid still names this process.
+    string dir = "/proc/" + to_string(pid);
+    ProcFiles files = {pid, _keepFd(open((dir + "/stat").c_str(), O_RDONLY | O_CLOEXEC)),
+                       _keepFd(open((dir + "/statm").c_str(), O_RDONLY | O_CLOEXEC)), 0, 0};
+    job.proc_files.push_back(files);
+    return job.proc_files.back();
+}
+
+long JobsList::sampleJob(JobEntry& job, unsigned long long now_ns, double *cpu_share) {
+    long rss_kb = 0;
+    for (pid_t pid : job.pids) {
+        long process_kb = _sampleProcess(_procFiles(job, pid), now_ns, job.start_ns, cpu_share);
+        if (process_kb > 0) rss_kb += process_kb;
+    }
+    return rss_kb;
+}
+
+double JobsList::jobCpuSecs(JobEntry& job) {
+    // The reaped processes are in usage, the others are read without disturbing jobs -s.
+    double cpu_secs = job.usage.user_secs + job.usage.sys_secs;
+    for (pid_t pid : job.pids) {
+        unsigned long long ticks;
+        if (_readTicks(_procFiles(job, pid).stat_fd, &ticks)) cpu_secs += (double) ticks / ticks_per_sec;
+    }
+    return cpu_secs;
+}
+
+void JobsList::printJobsSample() {
+    removeFinishedJobs();
+    unsigned long long now = _nowNs();
+    cout << fixed << setprecision(1);
+    for (JobEntry& job : *this) {
+        cout << "[" << job.job_id << "] " << job.aliased_command << ": ";
+        if (job.isQueued) {
+            cout << (job.isStopped ? "queued, stopped" : "queued") << endl;
+            continue;
+        }
+        double cpu_share = 0;
+        long rss_kb = sampleJob(job, now, &cpu_share);
+        cout << setprecision(3) << "running for " << (now - job.start_ns) / 1e9 << " secs" << setprecision(1)
+             << ", cpu " << cpu_share * 100 << "%, rss " << rss_kb << " KiB" << endl;
+    }
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+}
+
+void JobsList::printCommandStats() {
+    vector<pair<string, const CommandStats*>> sorted;
+    for (const auto& named : command_stats) sorted.push_back(make_pair(named.first, &named.second));
+    // The commands that cost the most wall time in total first.
+    stable_sort(sorted.begin(), sorted.end(), [](const pair<string, const CommandStats*>& a,
+                                                 const pair<string, const CommandStats*>& b) {
+        return a.second->total_secs > b.second->total_secs;
+    });
+    cout << fixed << setprecision(3);
+    for (const auto& named : sorted) {
+        const CommandStats& stats = *named.second;
+        cout << named.first << ": " << stats.count << (stats.count == 1 ? " job" : " jobs") << ", p50 "
+             << stats.percentile(50) << " secs, p95 " << stats.percentile(95) << " secs, total "
+             << stats.total_secs << " secs, peak rss " << stats.peak_rss_kb << " KiB" << endl;
+    }
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+}
+
+bool JobsList::reapUntil(unsigned long long deadline_ns) {
+    bool isForked = getpid() != shell_pid;
+    while (true) {
+        if (!isForked) {
+            reapChildren();
+        } else {
+            // quit under redirection runs in a child of smash, which sees the jobs exit
+            // through pidfds only. Unreaped, their pids are not recycled.
+            vector<pid_t> exited;
+            for (JobEntry& job : *this) {
+                for (pid_t pid : job.pids) {
+                    struct pollfd exit_poll = {(int) syscall(SYS_pidfd_open, pid, 0), POLLIN, 0};
+                    if (exit_poll.fd == -1) continue;
+                    if (poll(&exit_poll, 1, 0) > 0) exited.push_back(pid);
+                    close(exit_poll.fd);
+                }
+            }
+            for (pid_t pid : exited) processExited(pid);
+        }
+        bool isRunning = false;
+        for (JobEntry& job : *this) {
+            if (!job.pids.empty()) isRunning = true;
+        }
+        unsigned long long now = _nowNs();
+        if (!isRunning) return true;
+        if (now >= deadline_ns) return false;
+        // Without the signalfd every exit has to be looked for.
+        int timeout_ms = (int) ((deadline_ns - now + 999999) / 1000000);
+        struct pollfd child_poll = {child_fd, POLLIN, 0};
+        poll(&child_poll, 1, child_fd == -1 || isForked ? min(timeout_ms, 10) : timeout_ms);
+    }
+}
+
+void JobsList::killAllJobs(double grace_secs) {
+    // Queued jobs never start, they leave with the queue.
+    vector<int> queued;
+    for (JobEntry& job : *this) {
+        if (job.isQueued) queued.push_back(job.job_id);
+    }
+    for (int job_id : queued) removeJobById(job_id);
+    queued_ids.clear();
+    if (grace_secs > 0) {
+        for (JobEntry& job : *this) {
+            if (signalJob(&job, SIGTERM) != 0) perror("smash error: kill failed");
+            signalJob(&job, SIGCONT);      // a stopped job only sees SIGTERM once it runs
+        }
+        reapUntil(_nowNs() + (unsigned long long) (grace_secs * 1e9));
+    }
+    for (JobEntry& job : *this) {
+        if (!job.pids.empty() && signalJob(&job, SIGKILL) != 0) perror("smash error: kill failed");
+    }
+    reapUntil(_nowNs() + KILL_REAP_MS * 1000000ULL);
+    queue_running = 0;
+    throttled_num = 0;
+    jobs_table.clear();
+    slot_by_id.clear();
+    slot_by_pid.clear();
+    finished_ids.clear();
+    capturing_ids.clear();
+    live_num = 0;
+}
+
+void JobsList::removeFinishedJobs() {
+    for (int job_id : finished_ids) {
+        auto found = slot_by_id.find(job_id);
+        // The id may have been removed and handed to a newer job meanwhile.
+        if (found != slot_by_id.end() && jobs_table[found->second].pids.empty() &&
+            !jobs_table[found->second].isQueued) {
+            removeSlot(found->second);
+        }
+    }
+    finished_ids.clear();
+}
+
+
+void ExternalCommand::execute() {
+    SmallShell& smallShell = SmallShell::getInstance();
+    const ShellOptions& options = smallShell.getOptions();
+    if (!isBackground || !options.bg_capture) {
+        launch(SpawnAttrs());
+        return;
+    }
+    int capture[2];
+    if (pipe2(capture, O_CLOEXEC) == -1) {
+        perror("smash error: pipe failed");
+        return;
+    }
+    SpawnAttrs attrs;
+    attrs.dups.push_back(make_pair(capture[1], STDOUT_FILENO));
+    attrs.dups.push_back(make_pair(capture[1], STDERR_FILENO));
+    pid_t pid = spawn(attrs);
+    close(capture[1]);
+    if (pid == -1) {
+        close(capture[0]);
+        return;
+    }
+    smallShell.waitOrAddJob(this, vector<pid_t>(1, pid));
+    smallShell.getJobsList()->captureOutput(pid, capture[0], options.bg_buffer);
+}
+
+void KillCommand::execute() {
+    bool isValid = command_args.size() >= 2 && command_args[0][0] == '-' && is_number(command_args[0].substr(1))
+                   && command_args[0].size() < 11;
+    vector<pair<int, int>> ranges;
+    for (size_t i = 1; isValid && i < command_args.size(); i++) {
+        string target = command_args[i][0] == '%' ? command_args[i].substr(1) : command_args[i];
+        size_t dash = target.find('-');
+        string first = target.substr(0, dash), last = dash == string::npos ? first : target.substr(dash + 1);
+        isValid = is_number(first) && is_number(last) && first.size() < 10 && last.size() < 10 &&
+                  stoi(first) <= stoi(last) && (dash == string::npos || command_args[i][0] != '%');
+        if (isValid) ranges.push_back(make_pair(stoi(first), stoi(last)));
+    }
+    if (!isValid) {
+        cerr << "smash error: kill: invalid arguments" << endl;
+        return;
+    }
+
+    int signal = stoi(command_args[0].substr(1));
+    set<int> signalled;
+    for (const pair<int, int>& range : ranges) {
+        vector<int> ids;
+        if (range.first == range.second) {
+            if (jobs->getJobById(range.first) == nullptr) {
+                cerr << "smash error: kill: job-id " << range.first << " does not exist" << endl;
+                continue;
+            }
+            ids.push_back(range.first);
+        } else {
+            // Walks the jobs, not the ids, a range may be far wider than the table.
+            for (JobsList::JobEntry& job : *jobs) {
+                if (job.job_id >= range.first && job.job_id <= range.second) ids.push_back(job.job_id);
+            }
+        }
+        for (int id : ids) {
+            if (!signalled.insert(id).second) continue;
+            JobsList::JobEntry* curr_job = jobs->getJobById(id);
+            if (curr_job == nullptr) continue;      // a queued job that an earlier signal dropped
+            if (curr_job->isQueued) {
+                cout << "signal number " << signal << " was sent to queued job " << id << endl;
+            } else {
+                cout << "signal number " << signal << " was sent to pid " << curr_job->job_pid << endl;
+            }
+            if (jobs->signalJob(curr_job, signal) == -1) perror("smash error: kill failed");
+        }
+    }
+}
+
+void JobsCommand::execute() {
+    if (!command_args.empty() && command_args[0] == "-v") {
+        jobs->printJobsVerbose();
+        return;
+    }
+    if (!command_args.empty() && command_args[0] == "-s") {
+        jobs->printJobsSample();
+        return;
+    }
+    if (!command_args.empty() && command_args[0] == "--live") {
+        double interval_secs = 1;
+        if (command_args.size() > 2 || (command_args.size() > 1 && !parseSecs(command_args[1], &interval_secs))
+            || interval_secs <= 0) {
+            cerr << "smash error: jobs: invalid arguments" << endl;
+            return;
+        }
+        printLive(interval_secs);
+        return;
+    }
+    if (command_args.empty() || (command_args[0] != "-o" && command_args[0] != "-f")) {
+        jobs->printJobsList();
+        return;
+    }
+    if (command_args.size() != 2 || !is_number(command_args[1]) || command_args[1].size() >= 10) {
+        cerr << "smash error: jobs: invalid arguments" << endl;
+        return;
+    }
+    printOutput(stoi(command_args[1]), command_args[0] == "-f");
+}
+
+void JobsCommand::printLive(double interval_secs) {
+    while (true) {
+        jobs->printJobsSample();
+        if (jobs->empty()) return;
+        cout << endl;
+        unsigned long long deadline = _nowNs() + (unsigned long long) (interval_secs * 1e9);
+        for (unsigned long long now = _nowNs(); now < deadline; now = _nowNs()) {
+            vector<struct pollfd> polls(1, {jobs->getChildFd(), POLLIN, 0});
+            jobs->addOutputPolls(polls);
+            int timeout_ms = _soonerMs((int) ((deadline - now + 999999) / 1000000), jobs->throttleRetryMs());
+            if (poll(polls.data(), polls.size(), timeout_ms) == -1) {
+                return;     // Ctrl-C
+            }
+            jobs->throttleJobs();
+            jobs->drainOutputs();
+            if (polls[0].revents & POLLIN) {
+                jobs->reapChildren();
+                jobs->startQueued();
+            }
+        }
+    }
+}
+
+void JobsCommand::printOutput(int jobId, bool follow) {
+    jobs->drainOutputs();
+    JobOutput *output = jobs->getOutput(jobId);
+    if (output == nullptr) {
+        if (jobs->getJobById(jobId) == nullptr) {
+            cerr << "smash error: jobs: job-id " << jobId << " does not exist" << endl;
+        } else {
+            cerr << "smash error: jobs: job-id " << jobId << " has no captured output" << endl;
+        }
+        return;
+    }
+    unsigned long long printed = output->writeTo(STDOUT_FILENO, 0);
+    while (follow && output->fd != -1) {
+        vector<struct pollfd> polls(1, {jobs->getChildFd(), POLLIN, 0});
+        jobs->addOutputPolls(polls);
+        if (poll(polls.data(), polls.size(), jobs->throttleRetryMs()) == -1) break;     // Ctrl-C stops following
+        jobs->throttleJobs();
+        jobs->drainOutputs();
+        if (polls[0].revents & POLLIN) {
+            jobs->reapChildren();
+            jobs->startQueued();
+        }
+        // A queued job that started may have pushed this output out of the kept ones.
+        output = jobs->getOutput(jobId);
+        if (output == nullptr) break;
+        printed = output->writeTo(STDOUT_FILENO, printed);
+    }
+}
+
+void JobsList::captureOutput(pid_t pid, int fd, size_t capacity) {
+    auto found = slot_by_pid.find(pid);
+    if (found == slot_by_pid.end()) {
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    JobEntry& job = jobs_table[found->second];
+    job.output.reset(new JobOutput(fd, capacity));
+    if (std::find(capturing_ids.begin(), capturing_ids.end(), job.job_id) == capturing_ids.end()) {
+        capturing_ids.push_back(job.job_id);
+    }
+}
+
+JobOutput *JobsList::openOutput(int job_id) {
+    JobEntry *job = getJobById(job_id);
+    return job != nullptr && job->output && job->output->fd != -1 ? job->output.get() : nullptr;
+}
+
+JobOutput *JobsList::getOutput(int jobId) {
+    JobEntry *job = getJobById(jobId);
+    if (job != nullptr) return job->output.get();
+    for (auto kept = finished_outputs.rbegin(); kept != finished_outputs.rend(); ++kept) {
+        if (kept->first == jobId) return kept->second.get();
+    }
+    return nullptr;
+}
+
+// These walk the capturing jobs only, so that a command or a pass of the prompt costs
+// the same however many jobs there are.
+void JobsList::addOutputPolls(vector<struct pollfd>& polls) {
+    for (int job_id : capturing_ids) {
+        JobOutput *output = openOutput(job_id);
+        if (output != nullptr) polls.push_back({output->fd, POLLIN, 0});
+    }
+    for (auto& kept : finished_outputs) {
+        if (kept.second->fd != -1) polls.push_back({kept.second->fd, POLLIN, 0});
+    }
+}
+
+void JobsList::drainOutputs() {
+    // A job drops out once its pipe is closed or it is removed, its output moves to
+    // finished_outputs then.
+    size_t kept_num = 0;
+    for (int job_id : capturing_ids) {
+        JobOutput *output = openOutput(job_id);
+        if (output != nullptr) output->drain();
+        if (openOutput(job_id) != nullptr) capturing_ids[kept_num++] = job_id;
+    }
+    capturing_ids.resize(kept_num);
+    for (auto& kept : finished_outputs) kept.second->drain();
+}
+
+bool JobsList::capturing() {
+    for (int job_id : capturing_ids) {
+        if (openOutput(job_id) != nullptr) return true;
+    }
+    for (auto& kept : finished_outputs) {
+        if (kept.second->fd != -1) return true;
+    }
+    return false;
+}
+
+JobsList::JobEntry *JobsList::getJobById(int jobId) {
+    auto found = slot_by_id.find(jobId);
+    return found == slot_by_id.end() ? nullptr : &jobs_table[found->second];
+}
+
+void JobsList::removeJobById(int jobId) {
+    auto found = slot_by_id.find(jobId);
+    if (found != slot_by_id.end()) removeSlot(found->second);
+}
+
+void JobsList::removeJobByPid(int jobPid) {
+    auto found = slot_by_pid.find(jobPid);
+    if (found != slot_by_pid.end() && jobs_table[found->second].job_pid == jobPid) removeSlot(found->second);
+}
+
+
+int JobsList::addWaitingEntry(const string& command_line, bool needsAdmission) {
+    removeFinishedJobs();
+    int job_id = jobs_table.empty() ? 1 : jobs_table.back().job_id + 1;
+    size_t slot = jobs_table.size();
+    jobs_table.emplace_back(job_id, command_line, needsAdmission);
+    slot_by_id[job_id] = slot;
+    live_num++;
+    return job_id;
+}
+
+bool JobsList::launchEntry(int jobId) {
+    // The command registers itself through addJob(), which fills in this entry.
+    starting_id = jobId;
+    SmallShell& smallShell = SmallShell::getInstance();
+    // Limits and scheduling given to the job while it was queued, its command may add its own.
+    ResourceLimits saved_limits = smallShell.getCommandLimits();
+    SchedSettings saved_sched = smallShell.getCommandSched();
+    smallShell.setCommandLimits(getJobById(jobId)->limits.over(saved_limits));
+    smallShell.setCommandSched(getJobById(jobId)->sched.over(saved_sched));
+    Command *cmd = smallShell.CreateCommand(getJobById(jobId)->command_str.c_str());
+    cmd->execute();
+    delete cmd;
+    smallShell.setCommandLimits(saved_limits);
+    smallShell.setCommandSched(saved_sched);
+    starting_id = -1;
+    JobEntry *job = getJobById(jobId);
+    if (job != nullptr && job->isQueued) {
+        removeJobById(jobId);
+        return false;
+    }
+    return job != nullptr;
+}
+
+int JobsList::queueJob(const string& command_line, bool needsAdmission) {
+    int job_id = addWaitingEntry(command_line, needsAdmission);
+    getJobById(job_id)->fromQueue = true;
+    queued_ids.push_back(job_id);
+    startQueued();
+    return job_id;
+}
+
+int JobsList::runJob(const string& command_line) {
+    int job_id = addWaitingEntry(command_line, false);
+    return launchEntry(job_id) ? job_id : -1;
+}
+
+static bool _admitBatch(const ShellOptions& options) {
+    double max_load = options.batch_load > 0 ? options.batch_load : sysconf(_SC_NPROCESSORS_ONLN);
+    double load;
+    ifstream loadavg("/proc/loadavg");
+    if (loadavg >> load && load >= max_load) return false;
+    if (options.batch_mem == 0) return true;
+
+    ifstream meminfo("/proc/meminfo");
+    string key, rest;
+    unsigned long long kib;
+    while (meminfo >> key >> kib && getline(meminfo, rest)) {
+        if (key == "MemAvailable:") return kib * 1024 >= options.batch_mem;
+    }
+    return true;
+}
+
+void JobsList::startQueued() {
+    if (getpid() != shell_pid) return;
+    ShellOptions& options = SmallShell::getInstance().getOptions();
+    size_t slots = options.queue_slots > 0 ? options.queue_slots : sysconf(_SC_NPROCESSORS_ONLN);
+    admission_blocked = false;
+    auto it = queued_ids.begin();
+    while (it != queued_ids.end() && queue_running < slots) {
+        JobEntry *job = getJobById(*it);
+        if (job == nullptr || !job->isQueued) {
+            it = queued_ids.erase(it);
+            continue;
+        }
+        if (job->isStopped) {
+            ++it;
+            continue;
+        }
+        // Later jobs do not overtake a batch job that waits for the machine.
+        if (job->needsAdmission && !_admitBatch(options)) {
+            admission_blocked = true;
+            break;
+        }
+        int job_id = *it;
+        queued_ids.erase(it);
+        if (launchEntry(job_id)) queue_running++;
+        it = queued_ids.begin();
+    }
+}
+
+size_t JobsList::queueWaiting() const {
+    size_t waiting = 0;
+    for (int job_id : queued_ids) {
+        auto found = slot_by_id.find(job_id);
+        if (found != slot_by_id.end() && jobs_table[found->second].isQueued) waiting++;
+    }
+    return waiting;
+}
+
+void JobsList::runQueuedInForeground(int jobId) {
+    JobEntry *job = getJobById(jobId);
+    char *line = strdup(job->command_str.c_str());
+    _removeBackgroundSign(line);
+    string command_line = _trim(string(line));
+    free(line);
+    cout << command_line << endl;
+    removeJobById(jobId);
+    Command *cmd = SmallShell::getInstance().CreateCommand(command_line.c_str());
+    cmd->execute();
+    delete cmd;
+}
+
+JobsList::JobEntry *JobsList::getLastJob(int *lastJobId) {
+    *lastJobId = jobs_table.back().job_id;
+    return &jobs_table.back();
+}
+
+JobsList::JobEntry *JobsList::getLastStoppedJob(int *jobId) {
+    for (size_t slot = jobs_table.size(); slot > 0; slot--) {
+        JobEntry& job = jobs_table[slot - 1];
+        if (job.job_id != -1 && job.isStopped) {
+            *jobId = job.job_id;
+            return &job;
+        }
+    }
+    return nullptr;
+}
+
+Command::Command(const char *cmd_line) : command_str(cmd_line), aliased_command(cmd_line) {
+    isBackground = _isBackgroundComamnd(cmd_line);
+    char* new_cmd = strdup(cmd_line);
+    if (isBackground) _removeBackgroundSign(new_cmd);
+
+    istringstream stream(new_cmd);
+    string word;
+
+    if (stream >> word) {
+        command_name = word;
+    }
+    while (stream >> word) {
+        command_args.push_back(word);
+    }
+        
+    free(new_cmd);
+
+}
+
+RedirectionCommand::RedirectionCommand(const char *cmd_line) : Command(cmd_line) {
+    char* copy = strdup(command_str.c_str());
+    _removeBackgroundSign(copy);
+    command_str = _trim(string(copy));
+    free(copy);
+
+    string rest;
+    size_t pos = 0;
+    while (pos < command_str.size()) {
+        size_t op_len = 0;
+        Redirection redirection;
+        bool word_start = pos == 0 || WHITESPACE.find(command_str[pos - 1]) != string::npos;
+        if (command_str.compare(pos, 3, "2>>") == 0 && word_start) {
+            redirection.fd = STDERR_FILENO;
+            redirection.flags = O_WRONLY | O_CREAT | O_APPEND;
+            op_len = 3;
+        } else if (command_str.compare(pos, 2, "2>") == 0 && word_start) {
+            redirection.fd = STDERR_FILENO;
+            redirection.flags = O_WRONLY | O_CREAT | O_TRUNC;
+            op_len = 2;
+        } else if (command_str.compare(pos, 2, ">>") == 0) {
+            redirection.fd = STDOUT_FILENO;
+            redirection.flags = O_WRONLY | O_CREAT | O_APPEND;
+            op_len = 2;
+        } else if (command_str[pos] == '>') {
+            redirection.fd = STDOUT_FILENO;
+            redirection.flags = O_WRONLY | O_CREAT | O_TRUNC;
+            op_len = 1;
+        } else if (command_str[pos] == '<') {
+            redirection.fd = STDIN_FILENO;
+            redirection.flags = O_RDONLY;
+            op_len = 1;
+        }
+        if (op_len == 0) {
+            rest += command_str[pos++];
+            continue;
+        }
+        size_t name_start = command_str.find_first_not_of(WHITESPACE, pos + op_len);
+        if (name_start == string::npos) name_start = command_str.size();
+        size_t name_end = command_str.find_first_of(WHITESPACE + "<>", name_start);
+        if (name_end == string::npos) name_end = command_str.size();
+        redirection.file_name = command_str.substr(name_start, name_end - name_start);
+        redirections.push_back(redirection);
+        rest += ' ';
+        pos = name_end;
+    }
+    command_name_in_redir = _trim(rest);
+}
+
+void RedirectionCommand::execute() {
+    vector<int> file_fds;
+    for (const Redirection& redirection : redirections) {
+        int fd = open(redirection.file_name.c_str(), redirection.flags | O_CLOEXEC, 0664);
+        if (fd == -1) {
+            perror("smash error: open failed");
+            for (int file_fd : file_fds) close(file_fd);
+            return;
+        }
+        file_fds.push_back(fd);
+    }
+
+    SmallShell& smallShell = SmallShell::getInstance();
+    Command *cmd = smallShell.CreateCommand(command_name_in_redir.c_str());
+    ExternalCommand *external = dynamic_cast<ExternalCommand*>(cmd);
+    if (external != nullptr) {
+        SpawnAttrs attrs;
+        for (size_t i = 0; i < redirections.size(); i++) {
+            attrs.dups.push_back(make_pair(file_fds[i], redirections[i].fd));
+        }
+        pid_t pid = external->spawn(attrs);
+        if (pid != -1) smallShell.waitOrAddJob(this, vector<pid_t>(1, pid));
+    } else if (dynamic_cast<QuitCommand*>(cmd) != nullptr) {
+        // quit does not return, under redirection it ends a forked child instead of smash.
+        cout.flush();
+        cerr.flush();
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("smash error: fork failed");
+        } else if (pid == 0) {
+            setpgrp();
+            for (size_t i = 0; i < redirections.size(); i++) {
+                if (dup2(file_fds[i], redirections[i].fd) == -1) perror("smash error: dup2 failed");
+            }
+            cmd->execute();
+            _exit(0);
+        } else {
+            smallShell.setForegroundPid(pid);
+            if (waitpid(pid, nullptr, WUNTRACED) == -1) perror("smash error: waitpid failed");
+            smallShell.setForegroundPid(-1);
+        }
+    } else {
+        // A pipeline under redirection becomes the job itself, listed by the full line.
+        if (dynamic_cast<BuiltInCommand*>(cmd) == nullptr) {
+            cmd->isBackground = isBackground;
+            cmd->aliased_command = aliased_command;
+        }
+        cout.flush();
+        cerr.flush();
+        vector<int> saved_fds;
+        for (size_t i = 0; i < redirections.size(); i++) {
+            saved_fds.push_back(fcntl(redirections[i].fd, F_DUPFD_CLOEXEC, 10));
+            if (dup2(file_fds[i], redirections[i].fd) == -1) {
+                perror("smash error: dup2 failed");
+            }
+        }
+        cmd->execute();
+        cout.flush();
+        cerr.flush();
+        // Undo in reverse, the same fd may have been redirected twice.
+        for (size_t i = redirections.size(); i-- > 0;) {
+            if (saved_fds[i] == -1) {
+                close(redirections[i].fd);
+                continue;
+            }
+            dup2(saved_fds[i], redirections[i].fd);
+            close(saved_fds[i]);
+        }
+    }
+    for (int fd : file_fds) close(fd);
+    delete cmd;
+}
+
+PipeCommand::PipeCommand(const char *cmd_line) : Command(cmd_line), pipe_size(-1), isValid(true) {
+    char* copy = strdup(command_str.c_str());
+    _removeBackgroundSign(copy);
+    command_str = _trim(string(copy));
+    free(copy);
+
+    if (command_name == "pipesize") {
+        unsigned long long size;
+        if (command_args.empty() || !parseSize(command_args[0], &size) || size > INT_MAX) {
+            isValid = false;
+        } else {
+            pipe_size = (int) size;
+            size_t size_pos = command_str.find(command_args[0]);
+            command_str = _trim(command_str.substr(size_pos + command_args[0].size()));
+        }
+    }
+
+    fanout_start = 0;
+    size_t stage_start = 0;
+    for (size_t i = 0; i < command_str.size(); i++) {
+        if (command_str[i] != '|') continue;
+        stages.push_back(_trim(command_str.substr(stage_start, i - stage_start)));
+        bool isErr = i + 1 < command_str.size() && command_str[i + 1] == '&';
+        bool isFanout = i + 1 < command_str.size() && command_str[i + 1] == '+';
+        // Every stage after the first "|+" is a consumer of the fan-out.
+        if (isFanout && fanout_start == 0) fanout_start = stages.size();
+        else if (!isFanout && fanout_start != 0) isValid = false;
+        stderr_piped.push_back(isErr);
+        if (isErr || isFanout) i++;
+        stage_start = i + 1;
+    }
+    stages.push_back(_trim(command_str.substr(stage_start)));
+    if (fanout_start == 0) fanout_start = stages.size();
+}
+
+#define PIPE_BUFFER_CAPACITY (64 * 1024)
+
+PipeBuffer::PipeBuffer(int fd, size_t capacity) : buffer(capacity), fd(fd), broken(false) {
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+bool PipeBuffer::passOn() {
+    size_t len = pptr() - pbase();
+    if (fd != -1 && !broken) {
+        // A reader that exits early must not take smash down with SIGPIPE.
+        struct sigaction ignore, old_action;
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &ignore, &old_action);
+        for (size_t written = 0; written < len;) {
+            ssize_t res = write(fd, pbase() + written, len - written);
+            if (res == -1 && errno == EINTR) continue;
+            if (res == -1) {
+                broken = true;
+                break;
+            }
+            written += res;
+        }
+        sigaction(SIGPIPE, &old_action, nullptr);
+    }
+    setp(buffer.data(), buffer.data() + buffer.size());
+    return true;
+}
+
+PipeBuffer::int_type PipeBuffer::overflow(int_type ch) {
+    passOn();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+int PipeBuffer::sync() {
+    passOn();
+    return 0;
+}
+
+// tee(2) copies without consuming, it can not resume a copy that stopped half way.
+// The rest of such a chunk is tee'd into an empty scratch pipe, the part the consumer
+// already has is spliced away, and the remainder spliced on.
+static bool _teeChunk(int in_fd, int out_fd, size_t chunk, int scratch_fd[2], int null_fd) {
+    ssize_t copied = tee(in_fd, out_fd, chunk, 0);
+    if (copied == -1) return false;
+    if ((size_t) copied == chunk) return true;
+
+    if (tee(in_fd, scratch_fd[1], chunk, 0) != (ssize_t) chunk) return false;
+    bool ok = true;
+    for (size_t skipped = 0; skipped < (size_t) copied;) {
+        ssize_t res = splice(scratch_fd[0], nullptr, null_fd, nullptr, copied - skipped, 0);
+        if (res <= 0) return false;
+        skipped += res;
+    }
+    for (size_t left = chunk - copied; left > 0;) {
+        ssize_t res = splice(scratch_fd[0], nullptr, ok ? out_fd : null_fd, nullptr, left, 0);
+        if (res <= 0) {
+            if (!ok) return false;
+            ok = false;     // the consumer is gone, still empty the scratch pipe
+            continue;
+        }
+        left -= res;
+    }
+    return ok;
+}
+
+// The relay process of a fan-out. Every consumer but the last gets a tee'd copy of
+// each chunk, the last one gets the chunk itself spliced, which consumes it.
+static void _runFanoutRelay(int in_fd, const vector<int>& out_fds, int stats_fd) {
+    signal(SIGPIPE, SIG_IGN);
+    size_t consumers = out_fds.size();
+    vector<PipelineReport::RawRow> stats(consumers);
+    vector<bool> alive(consumers, true);
+    size_t alive_num = consumers;
+    memset(stats.data(), 0, sizeof(PipelineReport::RawRow) * consumers);
+
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int scratch_fd[2];
+    if (null_fd == -1 || pipe2(scratch_fd, O_CLOEXEC) == -1) _exit(1);
+    int in_size = fcntl(in_fd, F_GETPIPE_SZ);
+    if (in_size > 0) fcntl(scratch_fd[1], F_SETPIPE_SZ, in_size);
+
+    while (alive_num > 0) {
+        // splice() of the last consumer blocks until there is data or EOF, tee() to the
+        // others must know the size first.
+        struct pollfd in_poll = {in_fd, POLLIN, 0};
+        if (poll(&in_poll, 1, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        int available = 0;
+        if (ioctl(in_fd, FIONREAD, &available) == -1 || available == 0) break;
+        size_t chunk = available;
+
+        for (size_t i = 0; i + 1 < consumers; i++) {
+            if (!alive[i]) continue;
+            unsigned long long start = _nowNs();
+            if (_teeChunk(in_fd, out_fds[i], chunk, scratch_fd, null_fd)) {
+                stats[i].bytes += chunk;
+            } else {
+                alive[i] = false;
+                alive_num--;
+            }
+            stats[i].stalled_ns += _nowNs() - start;
+        }
+        size_t last = consumers - 1;
+        unsigned long long start = _nowNs();
+        for (size_t left = chunk; left > 0;) {
+            ssize_t res = splice(in_fd, nullptr, alive[last] ? out_fds[last] : null_fd, nullptr, left, 0);
+            if (res > 0) {
+                if (alive[last]) stats[last].bytes += res;
+                left -= res;
+            } else if (alive[last]) {
+                alive[last] = false;
+                alive_num--;
+            } else {
+                _exit(1);
+            }
+        }
+        stats[last].stalled_ns += _nowNs() - start;
+    }
+    ssize_t ignored = write(stats_fd, stats.data(), sizeof(PipelineReport::RawRow) * consumers);
+    (void) ignored;
+    _exit(0);
+}
+
+static int _pipeBytes(int fd) {
+    int bytes = 0;
+    ioctl(fd, FIONREAD, &bytes);
+    return bytes;
+}
+
+// The relay of a measured pipeline. links[i] is the output pipe of stage i and the
+// input pipe of stage i + 1, the relay moves the data between them and keeps track
+// of which side waits: a backlog it has no room for means the producer fills its pipe
+// and blocks writing, both pipes empty mean the consumer blocks reading.
+static void _runLinkRelay(const vector<pair<int, int>>& links, int stats_fd) {
+    signal(SIGPIPE, SIG_IGN);
+    enum LinkState { LINK_MOVING, LINK_FULL, LINK_EMPTY, LINK_CLOSED };
+    size_t links_num = links.size();
+    vector<PipelineReport::RawLink> stats(links_num);
+    vector<LinkState> states(links_num, LINK_EMPTY);
+    size_t open_num = links_num;
+    memset(stats.data(), 0, sizeof(PipelineReport::RawLink) * links_num);
+
+    unsigned long long last = _nowNs();
+    while (open_num > 0) {
+        vector<struct pollfd> polls;
+        for (size_t i = 0; i < links_num; i++) {
+            if (states[i] == LINK_CLOSED) continue;
+            struct pollfd link_poll = {links[i].first, POLLIN, 0};
+            if (states[i] == LINK_FULL) {
+                link_poll.fd = links[i].second;
+                link_poll.events = POLLOUT;
+            }
+            polls.push_back(link_poll);
+        }
+        if (poll(polls.data(), polls.size(), -1) == -1 && errno != EINTR) break;
+
+        unsigned long long now = _nowNs();
+        for (size_t i = 0; i < links_num; i++) {
+            if (states[i] == LINK_FULL) stats[i].full_ns += now - last;
+            if (states[i] == LINK_EMPTY) stats[i].empty_ns += now - last;
+        }
+        last = now;
+
+        for (size_t i = 0; i < links_num; i++) {
+            if (states[i] == LINK_CLOSED) continue;
+            ssize_t moved = splice(links[i].first, nullptr, links[i].second, nullptr, INT_MAX,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved > 0) stats[i].bytes += moved;
+            if (moved == 0 || (moved == -1 && errno != EAGAIN)) {
+                // EOF, or the consumer is gone and the producer gets SIGPIPE next.
+                close(links[i].first);
+                close(links[i].second);
+                states[i] = LINK_CLOSED;
+                open_num--;
+            } else if (_pipeBytes(links[i].first) > 0) {
+                states[i] = LINK_FULL;
+            } else {
+                states[i] = _pipeBytes(links[i].second) > 0 ? LINK_MOVING : LINK_EMPTY;
+            }
+        }
+    }
+    ssize_t ignored = write(stats_fd, stats.data(), sizeof(PipelineReport::RawLink) * links_num);
+    (void) ignored;
+    _exit(0);
+}
+
+// Forks a relay into the process group of the pipeline. Like fork(), returns 0 in the
+// child, which keeps only keep_fds out of pipe_fds.
+pid_t PipeCommand::forkRelay(pid_t pgid, const vector<int>& keep_fds, const vector<int>& pipe_fds) {
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("smash error: fork failed");
+        return -1;
+    }
+    if (pid == 0) {
+        // Ctrl-C reaches the relay through the process group, not through smash.
+        signal(SIGINT, SIG_DFL);
+        setpgid(0, pgid);
+        for (int fd : pipe_fds) {
+            if (find(keep_fds.begin(), keep_fds.end(), fd) == keep_fds.end()) close(fd);
+        }
+        return 0;
+    }
+    setpgid(pid, pgid == 0 ? pid : pgid);
+    return pid;
+}
+
+// Never more than an unprivileged process may ask for, read once per pipeline.
+int PipeCommand::pipeSize() const {
+    int size = pipe_size != -1 ? pipe_size : SmallShell::getInstance().getOptions().pipe_size;
+    if (size <= 0) return 0;
+    ifstream max_size_file("/proc/sys/fs/pipe-max-size");
+    int max_size;
+    if (max_size_file >> max_size && size > max_size) size = max_size;
+    return size;
+}
+
+void PipeCommand::setPipeSize(int fd, int size, bool *reported) {
+    if (size <= 0) return;
+    if (fcntl(fd, F_SETPIPE_SZ, size) == -1 && !*reported) {
+        perror("smash error: fcntl failed");
+        *reported = true;
+    }
+}
+
+void PipeCommand::execute() {
+    if (!isValid) {
+        cerr << "smash error: pipe: invalid arguments" << endl;
+        return;
+    }
+    SmallShell& smallShell = SmallShell::getInstance();
+    size_t stages_num = stages.size();
+    bool isFanout = fanout_start < stages_num;
+    // Measuring runs every stage as a process, a builtin stage would block smash
+    // before the relay even starts.
+    bool isMeasured = smallShell.getOptions().pipe_stats;
+
+    enum StageKind { STAGE_EXTERNAL, STAGE_FORKED, STAGE_IN_PROCESS };
+    vector<Command*> cmds;
+    vector<StageKind> kinds;
+    for (size_t i = 0; i < stages_num; i++) {
+        Command *cmd = smallShell.CreateCommand(stages[i].c_str());
+        cmds.push_back(cmd);
+        if (dynamic_cast<ExternalCommand*>(cmd) != nullptr) {
+            kinds.push_back(STAGE_EXTERNAL);
+        } else if (!isMeasured && !isBackground && cmd->isOutputOnly() && (i + 1 == stages_num || !stderr_piped[i])) {
+            kinds.push_back(STAGE_IN_PROCESS);
+        } else {
+            kinds.push_back(STAGE_FORKED);
+        }
+    }
+
+    // A real pipe only where a process sits on at least one side. The fan-out relay
+    // reads from the last producer and writes one pipe per consumer, the relay of a
+    // measured pipeline sits in the middle of every other pipe.
+    vector<int> in_fds(stages_num, -1), out_fds(stages_num, -1), pipe_fds;
+    int relay_in = -1, stats_fd[2] = {-1, -1}, link_stats_fd[2] = {-1, -1};
+    vector<int> relay_outs;
+    vector<pair<int, int>> links;
+    bool pipes_ok = (!isFanout || pipe2(stats_fd, O_CLOEXEC) == 0)
+                    && (!isMeasured || fanout_start < 2 || pipe2(link_stats_fd, O_CLOEXEC) == 0);
+    for (int fd : {stats_fd[0], stats_fd[1], link_stats_fd[0], link_stats_fd[1]}) {
+        if (fd != -1) pipe_fds.push_back(fd);
+    }
+    bool size_reported = false;
+    int size = pipeSize();
+    for (size_t i = 0; pipes_ok && i + 1 < stages_num; i++) {
+        if (i + 1 < fanout_start && kinds[i] == STAGE_IN_PROCESS && kinds[i + 1] == STAGE_IN_PROCESS) continue;
+        int my_pipe[2];
+        if (pipe2(my_pipe, O_CLOEXEC) == -1) {
+            pipes_ok = false;
+            break;
+        }
+        setPipeSize(my_pipe[1], size, &size_reported);
+        pipe_fds.push_back(my_pipe[0]);
+        pipe_fds.push_back(my_pipe[1]);
+        if (i + 1 < fanout_start && isMeasured) {
+            out_fds[i] = my_pipe[1];
+            int from_fd = my_pipe[0];
+            if (pipe2(my_pipe, O_CLOEXEC) == -1) {
+                pipes_ok = false;
+                break;
+            }
+            setPipeSize(my_pipe[1], size, &size_reported);
+            pipe_fds.push_back(my_pipe[0]);
+            pipe_fds.push_back(my_pipe[1]);
+            in_fds[i + 1] = my_pipe[0];
+            links.push_back(make_pair(from_fd, my_pipe[1]));
+            continue;
+        }
+        if (i + 1 < fanout_start) {
+            in_fds[i + 1] = my_pipe[0];
+            out_fds[i] = my_pipe[1];
+            continue;
+        }
+        if (relay_in == -1) {
+            relay_in = my_pipe[0];
+            out_fds[fanout_start - 1] = my_pipe[1];
+            if (pipe2(my_pipe, O_CLOEXEC) == -1) {
+                pipes_ok = false;
+                break;
+            }
+            setPipeSize(my_pipe[1], size, &size_reported);
+            pipe_fds.push_back(my_pipe[0]);
+            pipe_fds.push_back(my_pipe[1]);
+        }
+        in_fds[i + 1] = my_pipe[0];
+        relay_outs.push_back(my_pipe[1]);
+    }
+    if (!pipes_ok) {
+        perror("smash error: pipe failed");
+        for (int fd : pipe_fds) close(fd);
+        for (Command *cmd : cmds) delete cmd;
+        return;
+    }
+
+    pid_t pgid = 0;
+    vector<pid_t> pids;
+    vector<size_t> pid_stages;     // the stage of every pid, stages_num for a relay
+    GlobExpander globber;
+    for (size_t i = 0; i < stages_num; i++) {
+        if (kinds[i] == STAGE_IN_PROCESS) continue;
+        SpawnAttrs attrs;
+        attrs.pgid = pgid;
+        if (in_fds[i] != -1) {
+            attrs.dups.push_back(make_pair(in_fds[i], STDIN_FILENO));
+        }
+        if (out_fds[i] != -1) {
+            attrs.dups.push_back(make_pair(out_fds[i], stderr_piped[i] ? STDERR_FILENO : STDOUT_FILENO));
+        }
+
+        pid_t pid;
+        if (kinds[i] == STAGE_EXTERNAL) {
+            pid = dynamic_cast<ExternalCommand*>(cmds[i])->spawn(attrs, globber);
+        } else {
+            attrs.closes = pipe_fds;
+            pid = forkCommand(cmds[i], attrs);
+        }
+        if (pid == -1) continue;
+        if (pgid == 0) pgid = pid;
+        pids.push_back(pid);
+        pid_stages.push_back(i);
+    }
+    PipelineReport& report = smallShell.getPipelineReport();
+    if (isMeasured) {
+        report.start(command_str, stages);
+    } else if (isFanout) {
+        report.start(command_str, vector<string>(stages.begin() + fanout_start, stages.end()));
+    }
+    if (!links.empty()) {
+        vector<int> keep_fds(1, link_stats_fd[1]);
+        for (const pair<int, int>& link : links) {
+            keep_fds.push_back(link.first);
+            keep_fds.push_back(link.second);
+        }
+        pid_t pid = forkRelay(pgid, keep_fds, pipe_fds);
+        if (pid == 0) _runLinkRelay(links, link_stats_fd[1]);
+        if (pid != -1) {
+            if (pgid == 0) pgid = pid;
+            pids.push_back(pid);
+            pid_stages.push_back(stages_num);
+        }
+        close(link_stats_fd[1]);
+        for (const pair<int, int>& link : links) {
+            close(link.first);
+            close(link.second);
+        }
+        report.expect(0, links.size(), link_stats_fd[0], true);
+    }
+    if (isFanout) {
+        vector<int> keep_fds(relay_outs);
+        keep_fds.push_back(relay_in);
+        keep_fds.push_back(stats_fd[1]);
+        pid_t pid = forkRelay(pgid, keep_fds, pipe_fds);
+        if (pid == 0) _runFanoutRelay(relay_in, relay_outs, stats_fd[1]);
+        if (pid != -1) {
+            if (pgid == 0) pgid = pid;
+            pids.push_back(pid);
+            pid_stages.push_back(stages_num);
+        }
+        close(stats_fd[1]);
+        close(relay_in);
+        for (int fd : relay_outs) close(fd);
+        report.expect(isMeasured ? fanout_start : 0, stages_num - fanout_start, stats_fd[0], false);
+    }
+    // Keep only the write ends the builtin stages still have to fill. Builtins do not
+    // read their input, a process feeding one sees the pipe closed as with any reader
+    // that exits early.
+    for (size_t i = 0; i < stages_num; i++) {
+        if (kinds[i] != STAGE_IN_PROCESS && out_fds[i] != -1) close(out_fds[i]);
+        if (in_fds[i] != -1) close(in_fds[i]);
+    }
+
+    if (pgid != 0 && !isBackground) smallShell.setForegroundPid(pgid);
+    for (size_t i = 0; i < stages_num; i++) {
+        if (kinds[i] != STAGE_IN_PROCESS) continue;
+        bool feeds_builtin = i + 1 < fanout_start && kinds[i + 1] == STAGE_IN_PROCESS;
+        if (out_fds[i] == -1 && !feeds_builtin) {
+            cmds[i]->execute();
+            continue;
+        }
+        PipeBuffer output(out_fds[i], PIPE_BUFFER_CAPACITY);
+        streambuf *old_out = cout.rdbuf(&output);
+        cmds[i]->execute();
+        cout.flush();
+        cout.rdbuf(old_out);
+        if (out_fds[i] != -1) close(out_fds[i]);
+    }
+
+    vector<double> cpu_secs;
+    smallShell.waitOrAddJob(this, pids, isMeasured ? &cpu_secs : nullptr);
+    smallShell.setForegroundPid(-1);
+    for (size_t i = 0; i < cpu_secs.size(); i++) {
+        if (pid_stages[i] < stages_num) report.row(pid_stages[i]).cpu_secs = cpu_secs[i];
+    }
+    if ((isFanout || isMeasured) && !isBackground) report.collect(true);
+    for (Command *cmd : cmds) delete cmd;
+}
+
+struct _GraphNode {
+    enum State { NODE_WAITING, NODE_RUNNING, NODE_DONE, NODE_FAILED, NODE_SKIPPED };
+
+    string name;
+    string command;
+    vector<string> dep_names;
+    vector<size_t> deps;
+    vector<size_t> dependents;
+    size_t deps_left;
+    State state;
+    unsigned long long start_ns, end_ns;
+};
+
+// Reads "name : dependencies : command" lines, blank lines and lines starting with
+// '#' are skipped. Prints what is wrong with the graph and returns false.
+static bool _readGraph(const string& file_name, vector<_GraphNode>& nodes) {
+    ifstream file(file_name);
+    if (!file) {
+        perror("smash error: open failed");
+        return false;
+    }
+    unordered_map<string, size_t> node_by_name;
+    string line;
+    for (int line_num = 1; getline(file, line); line_num++) {
+        line = _trim(line);
+        if (line.empty() || line[0] == '#') continue;
+        size_t first = line.find(':');
+        size_t second = first == string::npos ? string::npos : line.find(':', first + 1);
+        _GraphNode node;
+        node.name = _trim(line.substr(0, first));
+        if (second != string::npos) node.command = _trim(line.substr(second + 1));
+        if (node.name.empty() || node.name.find_first_of(WHITESPACE) != string::npos || node.command.empty()) {
+            cerr << "smash error: rungraph: line " << line_num << ": expected name : dependencies : command" << endl;
+            return false;
+        }
+        if (node_by_name.count(node.name) != 0) {
+            cerr << "smash error: rungraph: node " << node.name << " is defined twice" << endl;
+            return false;
+        }
+        istringstream dep_words(line.substr(first + 1, second - first - 1));
+        string dep;
+        while (dep_words >> dep) node.dep_names.push_back(dep);
+        node.deps_left = node.dep_names.size();
+        node.state = _GraphNode::NODE_WAITING;
+        node.start_ns = node.end_ns = 0;
+        node_by_name[node.name] = nodes.size();
+        nodes.push_back(node);
+    }
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+        for (const string& dep : nodes[i].dep_names) {
+            auto found = node_by_name.find(dep);
+            if (found == node_by_name.end()) {
+                cerr << "smash error: rungraph: node " << nodes[i].name << " depends on unknown node " << dep << endl;
+                return false;
+            }
+            nodes[i].deps.push_back(found->second);
+            nodes[found->second].dependents.push_back(i);
+        }
+    }
+    // Kahn's order reaches every node unless some of them sit on a cycle.
+    vector<size_t> left(nodes.size()), order;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        left[i] = nodes[i].deps.size();
+        if (left[i] == 0) order.push_back(i);
+    }
+    for (size_t k = 0; k < order.size(); k++) {
+        for (size_t dependent : nodes[order[k]].dependents) {
+            if (--left[dependent] == 0) order.push_back(dependent);
+        }
+    }
+    for (size_t i = 0; order.size() < nodes.size() && i < nodes.size(); i++) {
+        if (left[i] != 0) {
+            cerr << "smash error: rungraph: node " << nodes[i].name << " is on a dependency cycle" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Marks everything that depends on node, directly or not, as skipped.
+static size_t _skipDependents(vector<_GraphNode>& nodes, size_t node) {
+    size_t skipped = 0;
+    for (size_t dependent : nodes[node].dependents) {
+        if (nodes[dependent].state != _GraphNode::NODE_WAITING) continue;
+        nodes[dependent].state = _GraphNode::NODE_SKIPPED;
+        cout << "smash: rungraph: " << nodes[dependent].name << " skipped" << endl;
+        skipped += 1 + _skipDependents(nodes, dependent);
+    }
+    return skipped;
+}
+
+void RunGraphCommand::execute() {
+    size_t width = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t arg = 0;
+    if (command_args.size() == 3 && command_args[0] == "-j" && is_number(command_args[1]) &&
+        command_args[1].size() < 10 && stoi(command_args[1]) > 0) {
+        width = stoi(command_args[1]);
+        arg = 2;
+    }
+    if (command_args.size() != arg + 1) {
+        cerr << "smash error: rungraph: invalid arguments" << endl;
+        return;
+    }
+    vector<_GraphNode> nodes;
+    if (!_readGraph(command_args[arg], nodes)) return;
+
+    deque<size_t> ready;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].deps.empty()) ready.push_back(i);
+    }
+    vector<pair<int, int>> exits;
+    unordered_map<int, size_t> node_by_job;
+    size_t running = 0, settled = 0;
+    bool interrupted = false;
+    unsigned long long start_ns = _nowNs();
+    jobs->setExitsSink(&exits);
+
+    while (settled < nodes.size() && !interrupted) {
+        vector<pair<size_t, int>> finished;     // node, exit status
+        while (!ready.empty() && running < width) {
+            size_t i = ready.front();
+            ready.pop_front();
+            nodes[i].start_ns = _nowNs();
+            int job_id = jobs->runJob(nodes[i].command);
+            if (job_id == -1) {
+                finished.push_back(make_pair(i, -1));
+                continue;
+            }
+            nodes[i].state = _GraphNode::NODE_RUNNING;
+            node_by_job[job_id] = i;
+            running++;
+        }
+        if (finished.empty() && exits.empty()) {
+            vector<struct pollfd> polls = {{jobs->getChildFd(), POLLIN, 0}, {jobs->getPressureFd(), POLLPRI, 0}};
+            jobs->addOutputPolls(polls);
+            if (poll(polls.data(), polls.size(),
+                     _soonerMs(jobs->getChildFd() == -1 ? 100 : -1,
+                               _soonerMs(jobs->memGuardRetryMs(), jobs->throttleRetryMs()))) == -1) {
+                interrupted = true;     // Ctrl-C, the running nodes stay background jobs
+                break;
+            }
+            jobs->guardMemory(polls[1].revents != 0);
+            jobs->throttleJobs();
+            jobs->drainOutputs();
+            jobs->reapChildren();
+            jobs->startQueued();
+        }
+        for (const pair<int, int>& job_exit : exits) {
+            auto found = node_by_job.find(job_exit.first);
+            if (found == node_by_job.end()) continue;
+            finished.push_back(make_pair(found->second, job_exit.second));
+            node_by_job.erase(found);
+            running--;
+        }
+        exits.clear();
+
+        for (const pair<size_t, int>& node_exit : finished) {
+            _GraphNode& node = nodes[node_exit.first];
+            node.end_ns = _nowNs();
+            settled++;
+            if (node_exit.second == 0) {
+                node.state = _GraphNode::NODE_DONE;
+                for (size_t dependent : node.dependents) {
+                    if (--nodes[dependent].deps_left == 0) ready.push_back(dependent);
+                }
+                continue;
+            }
+            node.state = _GraphNode::NODE_FAILED;
+            if (node_exit.second == -1) {
+                cout << "smash: rungraph: " << node.name << " did not start" << endl;
+            } else {
+                cout << "smash: rungraph: " << node.name << " failed with status " << node_exit.second << endl;
+            }
+            settled += _skipDependents(nodes, node_exit.first);
+        }
+    }
+    jobs->setExitsSink(nullptr);
+
+    size_t counts[5] = {0, 0, 0, 0, 0};
+    size_t last = nodes.size();
+    for (size_t i = 0; i < nodes.size(); i++) {
+        counts[nodes[i].state]++;
+        if (nodes[i].end_ns != 0 && (last == nodes.size() || nodes[i].end_ns > nodes[last].end_ns)) last = i;
+    }
+    cout << fixed << setprecision(3);
+    cout << "smash: rungraph: " << counts[_GraphNode::NODE_DONE] << " done, " << counts[_GraphNode::NODE_FAILED]
+         << " failed, " << counts[_GraphNode::NODE_SKIPPED] << " skipped";
+    if (interrupted) cout << ", " << counts[_GraphNode::NODE_RUNNING] << " left running";
+    cout << " in " << (_nowNs() - start_ns) / 1e9 << " secs" << endl;
+
+    // The critical path walks back from the node that finished last, each time to
+    // the dependency that finished last and so held the node back.
+    vector<size_t> path;
+    for (size_t i = last; i != nodes.size();) {
+        path.push_back(i);
+        size_t latest = nodes.size();
+        for (size_t dep : nodes[i].deps) {
+            if (latest == nodes.size() || nodes[dep].end_ns > nodes[latest].end_ns) latest = dep;
+        }
+        i = latest;
+    }
+    if (!path.empty()) {
+        cout << "smash: rungraph: critical path";
+        string sep = " ";
+        for (size_t k = path.size(); k > 0; k--) {
+            const _GraphNode& node = nodes[path[k - 1]];
+            cout << sep << node.name << " " << (node.end_ns - node.start_ns) / 1e9 << " secs";
+            sep = " -> ";
+        }
+        cout << ", " << (nodes[path.front()].end_ns - nodes[path.back()].start_ns) / 1e9 << " secs" << endl;
+    }
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+}
+
+struct _ParallelRun {
+    int job_id;
+    int fds[2];         // read ends of the run's stdout and stderr, -1 once drained
+    string output[2];
+    int status;         // -1 until the job exits
+};
+
+// Starts command as a job with its stdout and stderr going into two fresh pipes.
+static bool _startCaptured(JobsList *jobs, const string& command, _ParallelRun& run) {
+    int out_pipe[2], err_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC) == -1) {
+        perror("smash error: pipe failed");
+        return false;
+    }
+    if (pipe2(err_pipe, O_CLOEXEC) == -1) {
+        perror("smash error: pipe failed");
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return false;
+    }
+    cout.flush();
+    cerr.flush();
+    int saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    int saved_err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(out_pipe[1], STDOUT_FILENO);
+    dup2(err_pipe[1], STDERR_FILENO);
+    // The run writes into these pipes, not into a JobOutput of its own.
+    bool& bg_capture = SmallShell::getInstance().getOptions().bg_capture;
+    bool was_capturing = bg_capture;
+    bg_capture = false;
+    run.job_id = jobs->runJob(command);
+    bg_capture = was_capturing;
+    cout.flush();
+    cerr.flush();
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    run.fds[0] = out_pipe[0];
+    run.fds[1] = err_pipe[0];
+    return run.job_id != -1;
+}
+
+void ParallelCommand::execute() {
+    size_t width = sysconf(_SC_NPROCESSORS_ONLN);
+    bool isOrdered = false;
+    size_t arg = 0;
+    for (; arg < command_args.size(); arg++) {
+        if (command_args[arg] == "-k") {
+            isOrdered = true;
+        } else if (command_args[arg] == "-j" && arg + 1 < command_args.size() && is_number(command_args[arg + 1]) &&
+                   command_args[arg + 1].size() < 10 && stoi(command_args[arg + 1]) > 0) {
+            width = stoi(command_args[++arg]);
+        } else {
+            break;
+        }
+    }
+    string command;
+    for (; arg < command_args.size() && command_args[arg] != ":::"; arg++) {
+        command += (command.empty() ? "" : " ") + command_args[arg];
+    }
+    if (command.size() >= 2 && (command[0] == '\'' || command[0] == '"') && command.back() == command[0]) {
+        command = command.substr(1, command.size() - 2);
+    }
+    if (command.empty()) {
+        cerr << "smash error: parallel: invalid arguments" << endl;
+        return;
+    }
+    vector<string> inputs;
+    if (arg < command_args.size()) {
+        inputs.assign(command_args.begin() + arg + 1, command_args.end());
+    } else {
+        SmallShell& smash = SmallShell::getInstance();
+        string line;
+        while (smash.readLine(line)) {
+            if (!_trim(line).empty()) inputs.push_back(_trim(line));
+        }
+        // On a terminal Ctrl-D ends the arguments, not smash.
+        if (isatty(STDIN_FILENO)) smash.resetInput();
+    }
+
+    vector<_ParallelRun> runs(inputs.size());
+    vector<pair<int, int>> exits;
+    unordered_map<int, size_t> run_by_job;
+    size_t next_start = 0, next_print = 0, printed = 0, in_flight = 0, failed = 0;
+    vector<bool> isPrinted(inputs.size(), false);
+    jobs->setExitsSink(&exits);
+
+    while (printed < inputs.size()) {
+        while (next_start < inputs.size() && in_flight < width) {
+            _ParallelRun& run = runs[next_start];
+            string line = command;
+            size_t at = line.find("{}");
+            if (at == string::npos) line += " " + inputs[next_start];
+            for (; at != string::npos; at = line.find("{}", at + inputs[next_start].size())) {
+                line.replace(at, 2, inputs[next_start]);
+            }
+            run.fds[0] = run.fds[1] = -1;
+            run.status = -1;
+            if (_startCaptured(jobs, line, run)) {
+                run_by_job[run.job_id] = next_start;
+                in_flight++;
+            } else {
+                run.status = 127;   // what a shell reports for a command it could not run
+            }
+            next_start++;
+        }
+
+        // A run is through once it exited and both of its pipes reached end of file.
+        vector<struct pollfd> polls;
+        vector<pair<size_t, int>> poll_runs;
+        for (size_t i = next_print; i < next_start; i++) {
+            for (int k = 0; k < 2; k++) {
+                if (runs[i].fds[k] == -1) continue;
+                polls.push_back({runs[i].fds[k], POLLIN, 0});
+                poll_runs.push_back(make_pair(i, k));
+            }
+        }
+        if (exits.empty()) {
+            polls.push_back({jobs->getChildFd(), POLLIN, 0});
+            if (poll(polls.data(), polls.size(),
+                     _soonerMs(jobs->getChildFd() == -1 ? 100 : -1, jobs->throttleRetryMs())) == -1) {
+                // Ctrl-C, nobody would see the rest of the output.
+                for (const pair<const int, size_t>& running : run_by_job) {
+                    JobsList::JobEntry *job = jobs->getJobById(running.first);
+                    if (job != nullptr) jobs->signalJob(job, SIGKILL);
+                }
+                break;
+            }
+            jobs->throttleJobs();
+            if (polls.back().revents & POLLIN) {
+                jobs->reapChildren();
+                jobs->startQueued();
+            }
+            polls.pop_back();
+        }
+        for (size_t p = 0; p < polls.size(); p++) {
+            if (polls[p].revents == 0) continue;
+            _ParallelRun& run = runs[poll_runs[p].first];
+            int& fd = run.fds[poll_runs[p].second];
+            char chunk[4096];
+            ssize_t len = read(fd, chunk, sizeof(chunk));
+            if (len > 0) {
+                run.output[poll_runs[p].second].append(chunk, len);
+            } else if (len == 0 || errno != EINTR) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        for (const pair<int, int>& job_exit : exits) {
+            auto found = run_by_job.find(job_exit.first);
+            if (found == run_by_job.end()) continue;
+            runs[found->second].status = job_exit.second;
+            run_by_job.erase(found);
+            in_flight--;
+        }
+        exits.clear();
+
+        for (size_t i = next_print; i < next_start; i++) {
+            _ParallelRun& run = runs[i];
+            if (isPrinted[i] || run.status == -1 || run.fds[0] != -1 || run.fds[1] != -1) {
+                if (isOrdered) break;
+                continue;
+            }
+            cout << run.output[0] << flush;
+            cerr << run.output[1] << flush;
+            run.output[0].clear();
+            run.output[1].clear();
+            isPrinted[i] = true;
+            printed++;
+            failed += run.status != 0;
+        }
+        while (next_print < next_start && isPrinted[next_print]) next_print++;
+    }
+    jobs->setExitsSink(nullptr);
+    for (size_t i = next_print; i < next_start; i++) {
+        for (int fd : runs[i].fds) {
+            if (fd != -1) close(fd);
+        }
+    }
+    if (failed > 0) {
+        cout << "smash: parallel: " << failed << " of " << inputs.size() << " jobs failed" << endl;
+    }
+}
+
+static string _formatLoad(double load) {
+    ostringstream out;
+    out << load;
+    return out.str();
+}
+
+void QueueCommand::execute() {
+    ShellOptions& options = SmallShell::getInstance().getOptions();
+    string rest = _trim(command_str.substr(command_name.size()));
+    if (!isBatch && !command_args.empty() && command_args[0] == "-j") {
+        if (command_args.size() < 2 || !is_number(command_args[1]) || command_args[1].size() >= 10 ||
+            stoi(command_args[1]) == 0) {
+            cerr << "smash error: queue: invalid arguments" << endl;
+            return;
+        }
+        options.queue_slots = stoi(command_args[1]);
+        rest = _trim(rest.substr(2));
+        rest = _trim(rest.substr(command_args[1].size()));
+        jobs->startQueued();
+    }
+    if (rest.empty()) {
+        if (command_args.empty()) {
+            size_t slots = options.queue_slots > 0 ? options.queue_slots : sysconf(_SC_NPROCESSORS_ONLN);
+            cout << "queue: " << jobs->queueRunning() << " running, " << jobs->queueWaiting() << " queued, "
+                 << slots << " slots" << endl;
+        }
+        return;
+    }
+    char *line = strdup(rest.c_str());
+    _removeBackgroundSign(line);
+    jobs->queueJob(_trim(string(line)), isBatch);
+    free(line);
+}
+
+// What follows the first skipped arguments of a prefix builtin, as typed.
+static string _commandAfter(const Command& prefix, size_t skipped) {
+    const string& line = prefix.command_str;
+    size_t start = line.find(prefix.command_name) + prefix.command_name.size();
+    for (size_t i = 0; i < skipped; i++) {
+        start = line.find_first_not_of(WHITESPACE, start);
+        start = line.find_first_of(WHITESPACE, start);
+    }
+    return _trim(line.substr(start));
+}
+
+static void _printLimits(const ResourceLimits& limits) {
+    for (int kind = 0; kind < LIMITS_NUM; kind++) {
+        cout << limit_kinds[kind].name << " "
+             << (limits.has(kind) ? _formatLimit(kind, limits.values[kind]) : "default") << endl;
+    }
+}
+
+// Sets the soft limits of the running process pid.
+static bool _setLimits(pid_t pid, const ResourceLimits& limits) {
+    for (int kind = 0; kind < LIMITS_NUM; kind++) {
+        struct rlimit limit;
+        if (!limits.has(kind)) continue;
+        if (prlimit(pid, limit_kinds[kind].resource, nullptr, &limit) == -1) {
+            perror("smash error: prlimit failed");
+            return false;
+        }
+        if (limits.values[kind] > limit.rlim_max) {
+            cerr << "smash error: limit: " << limit_kinds[kind].name << " is above the hard limit" << endl;
+            return false;
+        }
+        limit.rlim_cur = limits.values[kind];
+        if (prlimit(pid, limit_kinds[kind].resource, &limit, nullptr) == -1) {
+            perror("smash error: prlimit failed");
+            return false;
+        }
+    }
+    return true;
+}
+
+void LimitCommand::execute() {
+    ResourceLimits limits, cleared;
+    bool isValid = true;
+    size_t i = 0;
+    for (; isValid && i < command_args.size() && command_args[i].size() == 2 && command_args[i][0] == '-'; i += 2) {
+        int kind = 0;
+        while (kind < LIMITS_NUM && limit_kinds[kind].option != command_args[i][1]) kind++;
+        isValid = kind < LIMITS_NUM && i + 1 < command_args.size();
+        if (!isValid) break;
+        const string& value = command_args[i + 1];
+        unsigned long long limit;
+        if (value == "unlimited") {
+            limit = RLIM_INFINITY;
+        } else if (value == "default") {
+            cleared.set |= 1u << kind;
+            continue;
+        } else {
+            isValid = value.size() < 19 && (limit_kinds[kind].isSize ? parseSize(value, &limit) : is_number(value));
+            if (!isValid) break;
+            if (!limit_kinds[kind].isSize) limit = stoull(value);
+        }
+        limits.values[kind] = limit;
+        limits.set |= 1u << kind;
+    }
+    bool isJob = isValid && i < command_args.size() && command_args[i][0] == '%';
+    if (!isValid || (isJob && (i + 1 != command_args.size() || !is_number(command_args[i].substr(1)) ||
+                               command_args[i].size() > 10)) ||
+        (cleared.set != 0 && i < command_args.size())) {
+        cerr << "smash error: limit: invalid arguments" << endl;
+        return;
+    }
+    // Nobody but root can raise a hard limit, check before anything changes.
+    for (int kind = 0; !isJob && kind < LIMITS_NUM; kind++) {
+        struct rlimit limit;
+        if (limits.has(kind) && getrlimit(limit_kinds[kind].resource, &limit) == 0 &&
+            limits.values[kind] > limit.rlim_max) {
+            cerr << "smash error: limit: " << limit_kinds[kind].name << " is above the hard limit" << endl;
+            return;
+        }
+    }
+
+    SmallShell& smallShell = SmallShell::getInstance();
+    if (isJob) {
+        int job_id = stoi(command_args[i].substr(1));
+        JobsList::JobEntry *job = jobs->getJobById(job_id);
+        if (job == nullptr) {
+            cerr << "smash error: limit: job-id " << job_id << " does not exist" << endl;
+            return;
+        }
+        if (limits.set == 0) {
+            _printLimits(job->limits);
+            return;
+        }
+        // Not reaped yet, so none of the pids is recycled. A queued job gets them once it starts.
+        for (pid_t pid : job->pids) {
+            if (!_setLimits(pid, limits)) return;
+        }
+        job->limits = limits.over(job->limits);
+        return;
+    }
+    if (i == command_args.size()) {
+        ResourceLimits& defaults = smallShell.getOptions().limits;
+        if (i == 0) {
+            _printLimits(defaults);
+            return;
+        }
+        defaults = limits.over(defaults);
+        defaults.set &= ~cleared.set;
+        return;
+    }
+
+    string rest = _commandAfter(*this, i);
+    ResourceLimits saved = smallShell.getCommandLimits();
+    smallShell.setCommandLimits(limits.over(saved));
+    Command *cmd = smallShell.CreateCommand(rest.c_str());
+    cmd->aliased_command = aliased_command;
+    cmd->execute();
+    delete cmd;
+    smallShell.setCommandLimits(saved);
+}
+
+// "0-3,8" -> cpus.
+static bool _parseCpuList(const string& list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    istringstream parts(list);
+    string part;
+    bool isEmpty = true;
+    while (getline(parts, part, ',')) {
+        size_t dash = part.find('-');
+        string first = part.substr(0, dash), last = dash == string::npos ? first : part.substr(dash + 1);
+        if (!is_number(first) || !is_number(last) || first.size() > 4 || last.size() > 4) return false;
+        int from = stoi(first), to = stoi(last);
+        if (from > to || to >= CPU_SETSIZE) return false;
+        for (int cpu = from; cpu <= to; cpu++) CPU_SET(cpu, cpus);
+        isEmpty = false;
+    }
+    return !isEmpty;
+}
+
+static string _formatCpuList(const cpu_set_t& cpus) {
+    string list;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &cpus)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &cpus)) last++;
+        if (!list.empty()) list += ",";
+        list += to_string(cpu) + (last > cpu ? "-" + to_string(last) : "");
+        cpu = last;
+    }
+    return list;
+}
+
+static bool _nodeCpus(const string& node, cpu_set_t *cpus) {
+    if (!is_number(node) || node.size() > 4) return false;
+    ifstream cpulist("/sys/devices/system/node/node" + node + "/cpulist");
+    string list;
+    return getline(cpulist, list) && _parseCpuList(list, cpus);
+}
+
+static const char *_policyName(int policy) {
+    switch (policy) {
+        case SCHED_OTHER: return "other";
+        case SCHED_BATCH: return "batch";
+        case SCHED_IDLE: return "idle";
+        case SCHED_FIFO: return "fifo";
+        case SCHED_RR: return "rr";
+    }
+    return "unknown";
+}
+
+// Every thread of every process in the process groups pgids, children of the jobs'
+// processes included, as (group, thread). One pass over /proc for all of them.
+static vector<pair<pid_t, pid_t>> _groupThreads(const set<pid_t>& pgids) {
+    vector<pair<pid_t, pid_t>> tids;
+    DIR *proc = opendir("/proc");
+    if (proc == nullptr) {
+        perror("smash error: opendir failed");
+        return tids;
+    }
+    struct dirent *process;
+    while ((process = readdir(proc)) != nullptr) {
+        if (!isdigit((unsigned char) process->d_name[0])) continue;
+        string dir = string("/proc/") + process->d_name;
+        char buffer[512];
+        int stat_fd = open((dir + "/stat").c_str(), O_RDONLY | O_CLOEXEC);
+        if (stat_fd == -1) continue;
+        ssize_t len = read(stat_fd, buffer, sizeof(buffer) - 1);
+        close(stat_fd);
+        if (len <= 0) continue;
+        buffer[len] = '\0';
+        char *fields = strrchr(buffer, ')');
+        int group;
+        if (fields == nullptr || sscanf(fields + 1, " %*c %*d %d", &group) != 1 || pgids.count(group) == 0) {
+            continue;
+        }
+        DIR *tasks = opendir((dir + "/task").c_str());
+        if (tasks == nullptr) continue;
+        struct dirent *task;
+        while ((task = readdir(tasks)) != nullptr) {
+            if (isdigit((unsigned char) task->d_name[0])) tids.push_back(make_pair(group, atoi(task->d_name)));
+        }
+        closedir(tasks);
+    }
+    closedir(proc);
+    return tids;
+}
+
+void SchedCommand::execute() {
+    SchedSettings sched;
+    string node;
+    bool isValid = true;
+    size_t i = 0;
+    if (isPin) {
+        isValid = !command_args.empty();
+        if (isValid && command_args[0].compare(0, 4, "node") == 0) {
+            node = command_args[0].substr(4);
+            isValid = !node.empty();
+        } else if (isValid) {
+            isValid = sched.hasCpus = _parseCpuList(command_args[0], &sched.cpus);
+        }
+        i = 1;
+    }
+    for (; !isPin && isValid && i < command_args.size() && command_args[i].size() == 2 &&
+           command_args[i][0] == '-'; i += 2) {
+        isValid = i + 1 < command_args.size();
+        if (!isValid) break;
+        const string& value = command_args[i + 1];
+        string digits = value[0] == '-' ? value.substr(1) : value;
+        switch (command_args[i][1]) {
+            case 'c':
+                isValid = sched.hasCpus = _parseCpuList(value, &sched.cpus);
+                break;
+            case 'N':
+                node = value;
+                break;
+            case 'n':
+                isValid = is_number(digits) && digits.size() < 4 && stoi(value) >= -20 && stoi(value) <= 19;
+                if (isValid) sched.nice = stoi(value);
+                sched.hasNice = true;
+                break;
+            case 'p':
+                isValid = false;
+                for (int policy : {SCHED_OTHER, SCHED_BATCH, SCHED_IDLE}) {
+                    if (value == _policyName(policy)) {
+                        sched.policy = policy;
+                        isValid = true;
+                    }
+                }
+                break;
+            default:
+                isValid = false;
+        }
+    }
+    bool isJob = isValid && i < command_args.size() && command_args[i][0] == '%';
+    if (!isValid || i >= command_args.size() || (isJob && (i + 1 != command_args.size() ||
+        !is_number(command_args[i].substr(1)) || command_args[i].size() > 10))) {
+        cerr << "smash error: " << command_name << ": invalid arguments" << endl;
+        return;
+    }
+    if (!node.empty()) {
+        cpu_set_t node_cpus;
+        if (!_nodeCpus(node, &node_cpus)) {
+            cerr << "smash error: " << command_name << ": node " << node << " has no cpus" << endl;
+            return;
+        }
+        if (sched.hasCpus) {
+            CPU_AND(&sched.cpus, &sched.cpus, &node_cpus);
+        } else {
+            sched.cpus = node_cpus;
+            sched.hasCpus = true;
+        }
+    }
+    cpu_set_t allowed;
+    if (sched.hasCpus && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        CPU_AND(&allowed, &allowed, &sched.cpus);
+        if (CPU_COUNT(&allowed) == 0) {
+            cerr << "smash error: " << command_name << ": none of the cpus is available" << endl;
+            return;
+        }
+    }
+
+    SmallShell& smallShell = SmallShell::getInstance();
+    if (isJob) {
+        int job_id = stoi(command_args[i].substr(1));
+        JobsList::JobEntry *job = jobs->getJobById(job_id);
+        if (job == nullptr) {
+            cerr << "smash error: " << command_name << ": job-id " << job_id << " does not exist" << endl;
+            return;
+        }
+        if (!sched.isSet()) {
+            SchedSettings current = job->sched;
+            pid_t pid = job->pids.empty() ? -1 : job->pids.front();
+            // What the kernel has for the leader, a queued job shows what it will start with.
+            if (pid != -1 && sched_getaffinity(pid, sizeof(current.cpus), &current.cpus) == 0) {
+                current.hasCpus = true;
+                current.policy = sched_getscheduler(pid) & ~SCHED_RESET_ON_FORK;
+                errno = 0;
+                current.nice = getpriority(PRIO_PROCESS, pid);
+                current.hasNice = errno == 0;
+            }
+            cout << "cpus " << (current.hasCpus ? _formatCpuList(current.cpus) : "default") << endl;
+            cout << "policy " << (current.policy >= 0 ? _policyName(current.policy) : "default") << endl;
+            cout << "nice " << (current.hasNice ? to_string(current.nice) : "default") << endl;
+            return;
+        }
+        if (!job->isQueued) {
+            for (const pair<pid_t, pid_t>& thread : _groupThreads(set<pid_t>{job->job_pid})) {
+                // A thread may exit meanwhile.
+                if (!sched.apply(thread.second) && errno != ESRCH) {
+                    perror("smash error: sched failed");
+                    return;
+                }
+            }
+        }
+        job->sched = sched.over(job->sched);
+        return;
+    }
+
+    string rest = _commandAfter(*this, i);
+    SchedSettings saved = smallShell.getCommandSched();
+    smallShell.setCommandSched(sched.over(saved));
+    Command *cmd = smallShell.CreateCommand(rest.c_str());
+    cmd->aliased_command = aliased_command;
+    cmd->execute();
+    delete cmd;
+    smallShell.setCommandSched(saved);
+}
+
+void ThrottleCommand::execute() {
+    string id = command_args.empty() ? "" : command_args[0];
+    if (!id.empty() && id[0] == '%') id = id.substr(1);
+    bool isValid = (command_args.size() == 1 || command_args.size() == 2) && is_number(id) && id.size() < 10;
+    int percent = 0;
+    if (isValid && command_args.size() == 2 && command_args[1] != "off") {
+        const string& value = command_args[1];
+        string digits = !value.empty() && value.back() == '%' ? value.substr(0, value.size() - 1) : value;
+        isValid = is_number(digits) && digits.size() < 4 && stoi(digits) >= 1 && stoi(digits) <= 100;
+        if (isValid) percent = stoi(digits);
+    }
+    if (!isValid) {
+        cerr << "smash error: throttle: invalid arguments" << endl;
+        return;
+    }
+    JobsList::JobEntry *job = jobs->getJobById(stoi(id));
+    if (job == nullptr) {
+        cerr << "smash error: throttle: job-id " << id << " does not exist" << endl;
+        return;
+    }
+    if (command_args.size() == 1) {
+        if (job->throttle.percent == 0) {
+            cout << "off" << endl;
+        } else {
+            cout << job->throttle.percent << "%" << endl;
+        }
+        return;
+    }
+    jobs->throttleJob(job, percent);
+}
+
+void JobsList::lowerJobs(FgBoost boost, pid_t foreground) {
+    set<pid_t> pgids;
+    unordered_map<pid_t, size_t> lowered_by_group;
+    for (JobEntry& job : *this) {
+        if (job.isQueued || job.isStopped || job.pids.empty() || job.job_pid == foreground) continue;
+        LoweredJob lowered = {job.job_id, job.job_pid, 0, vector<pair<pid_t, int>>()};
+        if (boost == FGBOOST_NICE) {
+            // The lowest nice in the group, the whole group gets it back.
+            errno = 0;
+            lowered.nice = getpriority(PRIO_PGRP, job.job_pid);
+            if (errno != 0 || lowered.nice >= FGBOOST_NICE_VALUE) continue;
+            if (setpriority(PRIO_PGRP, job.job_pid, FGBOOST_NICE_VALUE) == -1) continue;
+        } else {
+            pgids.insert(job.job_pid);
+            lowered_by_group[job.job_pid] = lowered_jobs.size();
+        }
+        lowered_jobs.push_back(lowered);
+    }
+    if (pgids.empty()) return;
+    struct sched_param param;
+    param.sched_priority = 0;
+    for (const pair<pid_t, pid_t>& thread : _groupThreads(pgids)) {
+        int policy = sched_getscheduler(thread.second);
+        // Real-time threads are left alone.
+        int base = policy & ~SCHED_RESET_ON_FORK;
+        if (policy == -1 || (base != SCHED_OTHER && base != SCHED_BATCH)) continue;
+        if (sched_setscheduler(thread.second, SCHED_IDLE, &param) == -1) continue;
+        lowered_jobs[lowered_by_group[thread.first]].policies.push_back(make_pair(thread.second, policy));
+    }
+}
+
+void JobsList::restoreJobs() {
+    struct sched_param param;
+    param.sched_priority = 0;
+    for (const LoweredJob& lowered : lowered_jobs) {
+        // A job that finished meanwhile may have left its pgid to another process.
+        JobEntry *job = getJobById(lowered.job_id);
+        if (job == nullptr || job->job_pid != lowered.pgid || job->pids.empty()) continue;
+        if (lowered.policies.empty() && setpriority(PRIO_PGRP, lowered.pgid, lowered.nice) == -1 &&
+            errno != ESRCH) {
+            perror("smash error: setpriority failed");
+        }
+        for (const pair<pid_t, int>& thread : lowered.policies) {
+            if (sched_setscheduler(thread.first, thread.second, &param) == -1 && errno != ESRCH) {
+                perror("smash error: sched_setscheduler failed");
+            }
+        }
+    }
+    lowered_jobs.clear();
+}
+
+// The "some" stall time in us that pressure_fd reports, -1 when it cannot be read.
+static long long _readStallUs(int fd) {
+    char buffer[256];
+    ssize_t len = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (len <= 0) return -1;
+    buffer[len] = '\0';
+    unsigned long long total;
+    if (sscanf(buffer, "some avg10=%*f avg60=%*f avg300=%*f total=%llu", &total) != 1) return -1;
+    return (long long) total;
+}
+
+bool JobsList::startMemGuard(const string& psi_path, int stall_ms) {
+    // A new threshold keeps the jobs stopped so far, they are resumed as usual.
+    if (pressure_fd != -1) close(pressure_fd);
+    pressure_fd = open(psi_path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (pressure_fd == -1) {
+        perror("smash error: open failed");
+        stopMemGuard();
+        return false;
+    }
+    // Only the PSI files of /proc and of cgroups take triggers, a write to any other file
+    // would succeed and never fire.
+    struct statfs fs;
+    bool isPsi = fstatfs(pressure_fd, &fs) == 0 &&
+                 (fs.f_type == PROC_SUPER_MAGIC || fs.f_type == CGROUP2_SUPER_MAGIC);
+    string trigger = "some " + to_string(stall_ms * 1000LL) + " " + to_string(MEMGUARD_WINDOW_US);
+    pressure_polled = isPsi && write(pressure_fd, trigger.c_str(), trigger.size() + 1) != -1;
+    long long total = _readStallUs(pressure_fd);
+    if (!pressure_polled && total == -1) {
+        cerr << "smash error: memguard: " << psi_path << " has no stall time" << endl;
+        stopMemGuard();
+        return false;
+    }
+    pressure_total = total == -1 ? 0 : total;
+    pressure_check_ns = _nowNs() + MEMGUARD_WINDOW_US * 1000ULL;
+    return true;
+}
+
+void JobsList::stopMemGuard() {
+    for (JobEntry& job : *this) {
+        if (job.memStopped && signalJob(&job, SIGCONT) != 0) perror("smash error: kill failed");
+    }
+    if (pressure_fd != -1) close(pressure_fd);
+    pressure_fd = -1;
+    pressure_polled = false;
+    pressure_ns = 0;
+}
+
+void JobsList::guardMemory(bool fired) {
+    if (pressure_fd == -1) return;
+    const ShellOptions& options = SmallShell::getInstance().getOptions();
+    unsigned long long now = _nowNs();
+    if (!pressure_polled && now >= pressure_check_ns) {
+        long long total = _readStallUs(pressure_fd);
+        if (total != -1 && (unsigned long long) total >= pressure_total + options.mem_stall_ms * 1000ULL) {
+            fired = true;
+        }
+        if (total != -1) pressure_total = total;
+        pressure_check_ns = now + MEMGUARD_WINDOW_US * 1000ULL;
+    }
+    if (fired) {
+        pressure_ns = now;
+        JobEntry *largest = nullptr;
+        long largest_kb = -1;
+        for (JobEntry& job : *this) {
+            if (job.isQueued || job.isStopped || job.pids.empty()) continue;
+            double cpu_share = 0;
+            long rss_kb = sampleJob(job, now, &cpu_share);
+            if (rss_kb > largest_kb) {
+                largest = &job;
+                largest_kb = rss_kb;
+            }
+        }
+        if (largest == nullptr) return;
+        if (signalJob(largest, SIGSTOP) != 0) {
+            perror("smash error: kill failed");
+            return;
+        }
+        largest->memStopped = true;
+        cout << "smash: memguard: stopped [" << largest->job_id << "] " << largest->aliased_command << ", rss "
+             << largest_kb << " KiB" << endl;
+        return;
+    }
+    if (pressure_ns == 0 || now - pressure_ns < options.mem_resume_secs * 1e9) return;
+    pressure_ns = 0;
+    for (JobEntry& job : *this) {
+        if (!job.memStopped) continue;
+        if (signalJob(&job, SIGCONT) != 0) {
+            perror("smash error: kill failed");
+            continue;
+        }
+        cout << "smash: memguard: resumed [" << job.job_id << "] " << job.aliased_command << endl;
+    }
+}
+
+// Milliseconds until next_ns, rounded up, -1 for ULLONG_MAX.
+static int _msUntil(unsigned long long next_ns) {
+    if (next_ns == ULLONG_MAX) return -1;
+    unsigned long long now = _nowNs();
+    return next_ns <= now ? 0 : (int) min((next_ns - now + 999999) / 1000000, (unsigned long long) INT_MAX);
+}
+
+int JobsList::memGuardRetryMs() const {
+    if (pressure_fd == -1) return -1;
+    unsigned long long next = ULLONG_MAX;
+    if (!pressure_polled) next = pressure_check_ns;
+    if (pressure_ns != 0) {
+        const ShellOptions& options = SmallShell::getInstance().getOptions();
+        next = min(next, pressure_ns + (unsigned long long) (options.mem_resume_secs * 1e9));
+    }
+    return _msUntil(next);
+}
+
+void JobsList::waitGuarded(pid_t pid) {
+    if (pressure_fd == -1 && throttled_num == 0) return;
+    int pidfd = (int) syscall(SYS_pidfd_open, pid, 0);
+    while (true) {
+        // Only looks, the caller reaps.
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_PID, pid, &info, WEXITED | WSTOPPED | WNOHANG | WNOWAIT) == -1 || info.si_pid != 0) break;
+        struct pollfd polls[2] = {{pidfd, POLLIN, 0}, {getPressureFd(), POLLPRI, 0}};
+        int timeout_ms = _soonerMs(memGuardRetryMs(), throttleRetryMs());
+        // A stop does not wake the pidfd.
+        if (timeout_ms == -1 || timeout_ms > MEMGUARD_STOP_CHECK_MS) timeout_ms = MEMGUARD_STOP_CHECK_MS;
+        poll(polls, 2, timeout_ms);
+        guardMemory(polls[1].revents != 0);
+        throttleJobs();
+    }
+    if (pidfd != -1) close(pidfd);
+}
+
+void JobsList::throttleJob(JobEntry *job, int percent) {
+    JobThrottle& throttle = job->throttle;
+    if (throttle.isStopped && !job->isStopped && signalGroup(job, SIGCONT) != 0 && errno != ESRCH) {
+        perror("smash error: kill failed");
+    }
+    if (throttle.percent == 0 && percent != 0) throttled_num++;
+    if (throttle.percent != 0 && percent == 0) throttled_num--;
+    // A new percent starts over with a fresh cycle and no credit.
+    throttle = JobThrottle();
+    throttle.percent = percent;
+}
+
+void JobsList::throttleJobs() {
+    if (throttled_num == 0) return;
+    unsigned long long now = _nowNs();
+    for (JobEntry& job : *this) {
+        JobThrottle& throttle = job.throttle;
+        if (throttle.percent == 0 || job.pids.empty() || (throttle.cycle_ns != 0 && now < throttle.switch_ns)) {
+            continue;
+        }
+        if (throttle.cycle_ns != 0 && !throttle.isStopped && throttle.run_ns < throttle.period_ns) {
+            // A job stopped by hand or by memguard stays so, throttle only keeps time.
+            if (!job.isStopped) signalGroup(&job, SIGSTOP);
+            throttle.isStopped = true;
+            throttle.ran_ns = now - throttle.cycle_ns;
+            throttle.switch_ns = throttle.cycle_ns + throttle.period_ns;
+            continue;
+        }
+
+        // The cycle is over, the next one runs for what the job is owed at the rate it
+        // used CPU time while it ran.
+        double share_secs = throttle.percent / 100.0 * THROTTLE_PERIOD_MS / 1e3;
+        double cpu_secs = jobCpuSecs(job);
+        if (throttle.cycle_ns == 0) {
+            throttle.run_ns = (unsigned long long) (share_secs * 1e9);
+            throttle.period_ns = THROTTLE_PERIOD_MS * 1000000ULL;
+        } else if (!job.isStopped) {
+            double used_secs = cpu_secs - throttle.cpu_secs;
+            double ran_secs = (throttle.isStopped ? throttle.ran_ns : now - throttle.cycle_ns) / 1e9;
+            double owed_secs = throttle.percent / 100.0 * (now - throttle.cycle_ns) / 1e9;
+            // The credit is kept to one cycle, a job that idled does not get a burst later.
+            double bound_secs = max(share_secs, owed_secs);
+            throttle.credit_secs = max(-bound_secs, min(bound_secs, throttle.credit_secs + owed_secs - used_secs));
+            throttle.used_secs = throttle.used_secs * THROTTLE_DECAY + used_secs;
+            throttle.ran_secs = throttle.ran_secs * THROTTLE_DECAY + ran_secs;
+            // The CPUs it keeps busy while it runs, one until it used a tick.
+            double cpus = throttle.used_secs > 0 && throttle.ran_secs > 0 ? throttle.used_secs / throttle.ran_secs : 1;
+            double run_secs = (share_secs + throttle.credit_secs) / cpus;
+            double min_run_secs = THROTTLE_MIN_RUN_MS / 1e3, period_secs = THROTTLE_PERIOD_MS / 1e3;
+            if (run_secs < min_run_secs) {
+                period_secs = run_secs > 0 ? min(period_secs * min_run_secs / run_secs,
+                                                 period_secs * THROTTLE_MAX_CYCLES)
+                                           : period_secs * THROTTLE_MAX_CYCLES;
+                run_secs = min_run_secs;
+            }
+            throttle.run_ns = (unsigned long long) (min(run_secs, period_secs) * 1e9);
+            throttle.period_ns = (unsigned long long) (period_secs * 1e9);
+        }
+        if (throttle.isStopped && !job.isStopped) signalGroup(&job, SIGCONT);
+        throttle.isStopped = false;
+        throttle.cpu_secs = cpu_secs;
+        throttle.cycle_ns = now;
+        throttle.switch_ns = now + throttle.run_ns;
+    }
+}
+
+void JobsList::releaseJobs() {
+    for (JobEntry& job : *this) {
+        if (job.throttle.percent != 0) throttleJob(&job, 0);
+    }
+    stopMemGuard();
+}
+
+int JobsList::throttleRetryMs() const {
+    if (throttled_num == 0) return -1;
+    unsigned long long next = ULLONG_MAX;
+    for (const JobEntry& job : jobs_table) {
+        if (job.job_id == -1 || job.throttle.percent == 0 || job.pids.empty()) continue;
+        next = min(next, job.throttle.cycle_ns == 0 ? 0 : job.throttle.switch_ns);
+    }
+    return _msUntil(next);
+}
+
+// By FgBoost.
+static const char *fgboost_names[] = {"off", "nice", "idle"};
+
+// Whether smash may raise the priority of a lowered job back to its own.
+static bool _canRaisePriority() {
+    struct rlimit nice_limit;
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, 0);
+    return geteuid() == 0 || (errno == 0 && getrlimit(RLIMIT_NICE, &nice_limit) == 0 &&
+                              (nice_limit.rlim_cur == RLIM_INFINITY || 20 - (long long) nice_limit.rlim_cur <= nice));
+}
+
+void SetOptCommand::execute() {
+    ShellOptions& options = SmallShell::getInstance().getOptions();
+    if (command_args.empty()) {
+        cout << "spawn " << spawnStrategyName(options.spawn_strategy) << endl;
+        cout << "pipesize " << (options.pipe_size == 0 ? "default" : to_string(options.pipe_size)) << endl;
+        cout << "pipestats " << (options.pipe_stats ? "on" : "off") << endl;
+        cout << "queueslots " << (options.queue_slots == 0 ? "default" : to_string(options.queue_slots)) << endl;
+        cout << "batchload " << (options.batch_load == 0 ? "default" : _formatLoad(options.batch_load)) << endl;
+        cout << "batchmem " << (options.batch_mem == 0 ? "default" : to_string(options.batch_mem)) << endl;
+        cout << "bgcapture " << (options.bg_capture ? "on" : "off") << endl;
+        cout << "bgbuffer " << options.bg_buffer << endl;
+        cout << "killgrace " << options.kill_grace << endl;
+        cout << "fgboost " << fgboost_names[options.fg_boost] << endl;
+        cout << "memguard " << (options.mem_guard ? "on" : "off") << endl;
+        cout << "memstall " << options.mem_stall_ms << endl;
+        cout << "memresume " << options.mem_resume_secs << endl;
+        cout << "mempsi " << options.mem_psi_path << endl;
+        return;
+    }
+    if (command_args.size() != 2) {
+        cerr << "smash error: setopt: invalid arguments" << endl;
+        return;
+    }
+    const string& name = command_args[0];
+    const string& value = command_args[1];
+    if (name == "spawn") {
+        const SpawnStrategy strategies[] = {SPAWN_POSIX, SPAWN_VFORK, SPAWN_CLONE, SPAWN_FORK};
+        for (SpawnStrategy strategy : strategies) {
+            if (value == spawnStrategyName(strategy)) {
+                options.spawn_strategy = strategy;
+                return;
+            }
+        }
+    } else if (name == "pipesize") {
+        unsigned long long size;
+        if (value == "default") {
+            options.pipe_size = 0;
+            return;
+        }
+        if (parseSize(value, &size) && size > 0 && size <= INT_MAX) {
+            options.pipe_size = (int) size;
+            return;
+        }
+    } else if (name == "queueslots") {
+        if (value == "default") {
+            options.queue_slots = 0;
+            return;
+        }
+        if (is_number(value) && value.size() < 10 && stoi(value) > 0) {
+            options.queue_slots = stoi(value);
+            SmallShell::getInstance().getJobsList()->startQueued();
+            return;
+        }
+    } else if (name == "batchload") {
+        char *end;
+        double load = strtod(value.c_str(), &end);
+        if (value == "default") {
+            options.batch_load = 0;
+            return;
+        }
+        if (!value.empty() && *end == '\0' && load > 0) {
+            options.batch_load = load;
+            return;
+        }
+    } else if (name == "batchmem") {
+        unsigned long long size;
+        if (value == "default") {
+            options.batch_mem = 0;
+            return;
+        }
+        if (parseSize(value, &size) && size > 0) {
+            options.batch_mem = size;
+            return;
+        }
+    } else if (name == "pipestats") {
+        if (value == "on" || value == "off") {
+            options.pipe_stats = value == "on";
+            return;
+        }
+    } else if (name == "killgrace") {
+        double grace;
+        if (parseSecs(value, &grace)) {
+            options.kill_grace = grace;
+            return;
+        }
+    } else if (name == "memguard") {
+        JobsList *jobs = SmallShell::getInstance().getJobsList();
+        if (value == "on") {
+            options.mem_guard = jobs->startMemGuard(options.mem_psi_path, options.mem_stall_ms);
+            return;
+        }
+        if (value == "off") {
+            jobs->stopMemGuard();
+            options.mem_guard = false;
+            return;
+        }
+    } else if (name == "memstall") {
+        // A trigger's threshold has to be below its window.
+        if (is_number(value) && value.size() < 10 && stoi(value) > 0 && stoi(value) < MEMGUARD_WINDOW_US / 1000) {
+            options.mem_stall_ms = stoi(value);
+            if (options.mem_guard) {
+                JobsList *jobs = SmallShell::getInstance().getJobsList();
+                options.mem_guard = jobs->startMemGuard(options.mem_psi_path, options.mem_stall_ms);
+            }
+            return;
+        }
+    } else if (name == "memresume") {
+        double resume;
+        if (parseSecs(value, &resume)) {
+            options.mem_resume_secs = resume;
+            return;
+        }
+    } else if (name == "mempsi") {
+        options.mem_psi_path = value == "default" ? MEMGUARD_PSI_PATH : value;
+        if (options.mem_guard) {
+            JobsList *jobs = SmallShell::getInstance().getJobsList();
+            options.mem_guard = jobs->startMemGuard(options.mem_psi_path, options.mem_stall_ms);
+        }
+        return;
+    } else if (name == "fgboost") {
+        for (FgBoost boost : {FGBOOST_OFF, FGBOOST_NICE, FGBOOST_IDLE}) {
+            if (value != fgboost_names[boost]) continue;
+            if (boost != FGBOOST_OFF && !_canRaisePriority()) {
+                cerr << "smash error: setopt: fgboost could not give the jobs their priority back" << endl;
+                return;
+            }
+            options.fg_boost = boost;
+            return;
+        }
+    } else if (name == "bgcapture") {
+        if (value == "on" || value == "off") {
+            options.bg_capture = value == "on";
+            return;
+        }
+    } else if (name == "bgbuffer") {
+        unsigned long long size;
+        if (parseSize(value, &size) && size > 0 && size <= INT_MAX) {
+            options.bg_buffer = size;
+            return;
+        }
+    } else {
+        cerr << "smash error: setopt: " << name << " is not an option" << endl;
+        return;
+    }
+    cerr << "smash error: setopt: invalid value for " << name << endl;
+}
+
+// epoll data of the memguard trigger, the others are 0 for SIGCHLD and pidfd indexes.
+#define WAIT_PRESSURE_EVENT (~0ULL)
+
+void WaitCommand::execute() {
+    vector<int> ids;
+    double timeout_secs = -1;
+    bool any = false;
+    for (size_t i = 0; i < command_args.size(); i++) {
+        const string& arg = command_args[i];
+        if (arg == "-n") {
+            any = true;
+            continue;
+        }
+        if (arg == "-t" && i + 1 < command_args.size()) {
+            if (parseSecs(command_args[++i], &timeout_secs)) continue;
+        } else {
+            string id = arg[0] == '%' ? arg.substr(1) : arg;
+            if (is_number(id) && id.size() < 10) {
+                ids.push_back(stoi(id));
+                continue;
+            }
+        }
+        cerr << "smash error: wait: invalid arguments" << endl;
+        return;
+    }
+
+    if (ids.empty()) {
+        for (JobsList::JobEntry& job : *jobs) ids.push_back(job.job_id);
+    }
+    for (int id : ids) {
+        if (jobs->getJobById(id) == nullptr) {
+            cerr << "smash error: wait: job-id " << id << " does not exist" << endl;
+            return;
+        }
+    }
+
+    // Pidfds of the processes waited for, opened here and not kept by the jobs, so that
+    // waiting costs descriptors only while it lasts.
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("smash error: epoll_create1 failed");
+        return;
+    }
+    vector<pair<pid_t, int>> watched;
+    for (int id : ids) {
+        JobsList::JobEntry *job = jobs->getJobById(id);
+        for (size_t i = 0; i < job->pids.size(); i++) {
+            int pidfd = _openPidfd(job->pids[i]);
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.u64 = watched.size() + 1;
+            if (pidfd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &event) == -1) {
+                if (pidfd != -1) close(pidfd);
+                continue;
+            }
+            watched.push_back(make_pair(job->pids[i], pidfd));
+        }
+    }
+    // Processes without a pidfd are only seen through SIGCHLD.
+    if (jobs->getChildFd() != -1) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = 0;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, jobs->getChildFd(), &event);
+    }
+    if (jobs->getPressureFd() != -1) {
+        struct epoll_event event;
+        event.events = EPOLLPRI;
+        event.data.u64 = WAIT_PRESSURE_EVENT;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, jobs->getPressureFd(), &event);
+    }
+
+    unsigned long long deadline = timeout_secs < 0 ? 0 : _nowNs() + (unsigned long long) (timeout_secs * 1e9);
+    while (true) {
+        // By id, a queued job that starts may drop finished jobs and move the others.
+        size_t finished = 0;
+        for (int id : ids) {
+            JobsList::JobEntry *job = jobs->getJobById(id);
+            if (job == nullptr || (job->pids.empty() && !job->isQueued)) finished++;
+        }
+        if (finished == ids.size() || (any && finished > 0)) break;
+
+        int timeout_ms = _soonerMs(jobs->queueRetryMs(), _soonerMs(jobs->memGuardRetryMs(), jobs->throttleRetryMs()));
+        // A job writing into a full capture pipe would never finish.
+        if (jobs->capturing()) {
+            jobs->drainOutputs();
+            if (timeout_ms == -1 || timeout_ms > CAPTURE_DRAIN_MS) timeout_ms = CAPTURE_DRAIN_MS;
+        }
+        if (deadline != 0) {
+            unsigned long long now = _nowNs();
+            int left_ms = now >= deadline ? 0 : (int) ((deadline - now + 999999) / 1000000);
+            if (timeout_ms == -1 || left_ms < timeout_ms) timeout_ms = left_ms;
+        }
+        struct epoll_event events[16];
+        int ready = epoll_wait(epoll_fd, events, 16, timeout_ms);
+        if (ready == -1) {
+            if (errno != EINTR) perror("smash error: epoll_wait failed");
+            break;      // Ctrl-C stops waiting
+        }
+        if (ready == 0 && deadline != 0 && _nowNs() >= deadline) {
+            cout << "smash: wait: timed out" << endl;
+            break;
+        }
+        bool isPressure = false;
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.u64 == 0) {
+                jobs->reapChildren();
+                continue;
+            }
+            if (events[i].data.u64 == WAIT_PRESSURE_EVENT) {
+                isPressure = true;
+                continue;
+            }
+            pair<pid_t, int>& process = watched[events[i].data.u64 - 1];
+            if (process.second == -1) continue;
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, process.second, nullptr);
+            close(process.second);
+            process.second = -1;
+            // In a forked pipeline stage the job is not our child and only its state is updated.
+            int status = 0;
+            struct rusage usage;
+            bool isReaped = wait4(process.first, &status, WNOHANG, &usage) > 0;
+            jobs->processExited(process.first, status, isReaped ? &usage : nullptr);
+        }
+        // Queued jobs start as slots free up, they are only seen through SIGCHLD.
+        jobs->startQueued();
+        jobs->guardMemory(isPressure);
+        jobs->throttleJobs();
+    }
+    for (const pair<pid_t, int>& process : watched) {
+        if (process.second != -1) close(process.second);
+    }
+    close(epoll_fd);
+}
+
+PipelineReport::~PipelineReport() {
+    for (const Pending& relay : pending) close(relay.fd);
+}
+
+void PipelineReport::start(const string& command_line, const vector<string>& labels) {
+    for (const Pending& relay : pending) close(relay.fd);
+    pending.clear();
+    this->command_line = command_line;
+    rows.clear();
+    for (const string& label : labels) {
+        Row row = {label, -1, -1, -1, -1, -1, -1};
+        rows.push_back(row);
+    }
+}
+
+void PipelineReport::expect(size_t first_row, size_t count, int fd, bool links) {
+    Pending relay = {fd, first_row, count, links};
+    pending.push_back(relay);
+}
+
+void PipelineReport::collect(bool wait) {
+    for (size_t i = 0; i < pending.size();) {
+        Pending relay = pending[i];
+        struct pollfd stats_poll = {relay.fd, POLLIN, 0};
+        if (!wait && poll(&stats_poll, 1, 0) <= 0) {
+            i++;
+            continue;
+        }
+        if (relay.links) {
+            vector<RawLink> raw(relay.count);
+            ssize_t len = read(relay.fd, raw.data(), sizeof(RawLink) * raw.size());
+            for (size_t j = 0; len == (ssize_t) (sizeof(RawLink) * raw.size()) && j < raw.size(); j++) {
+                Row& producer = rows[relay.first_row + j];
+                Row& consumer = rows[relay.first_row + j + 1];
+                producer.bytes_out = consumer.bytes_in = raw[j].bytes;
+                producer.full_secs = raw[j].full_ns / 1e9;
+                consumer.empty_secs = raw[j].empty_ns / 1e9;
+            }
+        } else {
+            vector<RawRow> raw(relay.count);
+            ssize_t len = read(relay.fd, raw.data(), sizeof(RawRow) * raw.size());
+            for (size_t j = 0; len == (ssize_t) (sizeof(RawRow) * raw.size()) && j < raw.size(); j++) {
+                rows[relay.first_row + j].bytes_in = raw[j].bytes;
+                rows[relay.first_row + j].stalled_secs = raw[j].stalled_ns / 1e9;
+            }
+        }
+        close(relay.fd);
+        pending.erase(pending.begin() + i);
+    }
+}
+
+void PipelineReport::print() {
+    collect(false);
+    if (command_line.empty()) return;
+    cout << command_line << (!pending.empty() ? " (running)" : "") << endl;
+    cout << fixed << setprecision(3);
+    for (const Row& row : rows) {
+        string sep = ": ";
+        cout << row.label;
+        if (row.bytes_in >= 0) {
+            cout << sep << "in " << row.bytes_in << " bytes";
+            sep = ", ";
+        }
+        if (row.bytes_out >= 0) {
+            cout << sep << "out " << row.bytes_out << " bytes";
+            sep = ", ";
+        }
+        if (row.full_secs >= 0) {
+            cout << sep << "full pipe " << row.full_secs << " secs";
+            sep = ", ";
+        }
+        if (row.empty_secs >= 0) {
+            cout << sep << "empty pipe " << row.empty_secs << " secs";
+            sep = ", ";
+        }
+        if (row.cpu_secs >= 0) {
+            cout << sep << "cpu " << row.cpu_secs << " secs";
+            sep = ", ";
+        }
+        if (row.stalled_secs >= 0) {
+            cout << sep << "stalled " << row.stalled_secs << " secs";
+        }
+        cout << endl;
+    }
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
 }
 
 aliasCommand::aliasCommand(const char *cmd_line, map<string, string>& alias_map, vector<string>& keys) : BuiltInCommand(cmd_line), alias_map(alias_map), keys(keys) {
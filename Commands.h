@@ -11,6 +11,7 @@
 #include "dirent.h"
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <pwd.h>
 #include <grp.h>
 #include <sys/stat.h>
@@ -18,6 +19,17 @@
 #include <cstdlib>
 #include <cstdio>
 #include <fcntl.h>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <iostream>
+#include <spawn.h>
+#include <unordered_map>
+#include <deque>
+#include <memory>
+#include <poll.h>
+#include <sched.h>
 
 using namespace std;
 
@@ -25,9 +37,130 @@ using namespace std;
 #define COMMAND_MAX_LENGTH (200)
 #define COMMAND_MAX_ARGS (20)
 #define MAX_BUFFER_SIZE (4096)
+// The longest time a builtin takes in seconds, a day, so that it fits in nanoseconds.
+#define MAX_SECS (24 * 3600)
 
 extern string curr_prompt;
 
+// How spawnProcess() creates the child. Everything except SPAWN_FORK shares the
+// parent's address space until exec, so the cost does not grow with smash's heap.
+enum SpawnStrategy {
+    SPAWN_POSIX,    // posix_spawnp(), glibc runs it on clone(CLONE_VM | CLONE_VFORK)
+    SPAWN_VFORK,    // vfork() and a child that only issues syscalls before exec
+    SPAWN_CLONE,    // clone(CLONE_VM | CLONE_VFORK) on a stack owned by smash
+    SPAWN_FORK      // plain fork(), copies the page tables of the whole shell
+};
+
+// Resources the limit builtin caps: -m address space, -t CPU seconds, -n open files,
+// -c core size, in this order.
+#define LIMITS_NUM 4
+
+// Soft limits of the processes smash starts, each resource only when its bit in set
+// is on. The hard limits stay as they are, so a job's limit can be raised again.
+struct ResourceLimits {
+    rlim_t values[LIMITS_NUM];
+    unsigned set;
+
+    ResourceLimits() : values(), set(0) {}
+
+    bool has(int kind) const {
+        return (set & (1u << kind)) != 0;
+    }
+
+    // These limits, with base filling in those that are not set.
+    ResourceLimits over(const ResourceLimits& base) const;
+
+    // setrlimit() for every set limit, only syscalls so a vfork child may call it.
+    bool apply() const;
+
+    // "mem 1G cpu 600", the set limits only.
+    string str() const;
+};
+
+// Where and how the processes smash starts are scheduled, each part only when set.
+struct SchedSettings {
+    cpu_set_t cpus;
+    bool hasCpus;
+    int policy;     // SCHED_OTHER, SCHED_BATCH or SCHED_IDLE, -1 - not set
+    int nice;
+    bool hasNice;
+
+    SchedSettings() : hasCpus(false), policy(-1), nice(0), hasNice(false) {
+        CPU_ZERO(&cpus);
+    }
+
+    bool isSet() const {
+        return hasCpus || policy != -1 || hasNice;
+    }
+
+    // These settings, with base filling in those that are not set.
+    SchedSettings over(const SchedSettings& base) const;
+
+    // Applies them to the thread tid, 0 - the caller. Only syscalls, like ResourceLimits::apply().
+    bool apply(pid_t tid) const;
+};
+
+// Everything the child has to do before exec. It is prepared in the parent, so the
+// child never allocates.
+struct SpawnAttrs {
+    pid_t pgid;                     // 0 - new group led by the child, -1 - stay in smash's group
+    vector<pair<int, int>> dups;    // dup2(first, second) in the child, in order
+    vector<int> closes;             // closed in the child after the dups
+    ResourceLimits limits;          // set in the child first, posix_spawn cannot so vfork does
+    SchedSettings sched;            // likewise
+
+    SpawnAttrs() : pgid(0) {}
+};
+
+// Starts file (execve'd as is if it contains a '/', searched in PATH otherwise) and returns its pid. On failure returns -1 with
+// errno set, a failed exec is reported here as well and the child is already reaped.
+pid_t spawnProcess(const char *file, char *const argv[], const SpawnAttrs &attrs,
+                   SpawnStrategy strategy = SPAWN_POSIX);
+
+const char *spawnStrategyName(SpawnStrategy strategy);
+
+// What setopt fgboost does to the running background jobs while a foreground job runs.
+enum FgBoost {
+    FGBOOST_OFF,
+    FGBOOST_NICE,   // their process groups get nice FGBOOST_NICE_VALUE
+    FGBOOST_IDLE    // their threads get SCHED_IDLE
+};
+
+#define FGBOOST_NICE_VALUE 19
+
+// The PSI file memguard watches by default, the stall time of the whole machine.
+#define MEMGUARD_PSI_PATH "/proc/pressure/memory"
+
+// Settings of the shell that the setopt builtin changes.
+struct ShellOptions {
+    SpawnStrategy spawn_strategy;
+    int pipe_size;                  // capacity of pipeline pipes in bytes, 0 - the kernel's default
+    bool pipe_stats;                // relay foreground pipelines through smash and measure every stage
+    int queue_slots;                // queued jobs that may run at once, 0 - the number of cores
+    double batch_load;              // batch jobs start below this load average, 0 - the number of cores
+    unsigned long long batch_mem;   // and with at least this much MemAvailable, 0 - any
+    bool bg_capture;                // background commands write into a JobOutput, not the terminal
+    size_t bg_buffer;               // bytes of a JobOutput kept in memory
+    double kill_grace;              // quit kill sends SIGTERM and waits this long before SIGKILL, 0 - no wait
+    bool mem_guard;                 // stop background jobs while the machine stalls on memory
+    int mem_stall_ms;               // the stall per MEMGUARD_WINDOW_US that counts as pressure
+    double mem_resume_secs;         // resume them once there was no pressure for this long
+    string mem_psi_path;            // the PSI file memguard watches, a cgroup's memory.pressure too
+    ResourceLimits limits;          // of every process smash starts, limit without a command sets them
+    FgBoost fg_boost;
+
+    ShellOptions() : spawn_strategy(SPAWN_POSIX), pipe_size(0), pipe_stats(false), queue_slots(0),
+                     batch_load(0), batch_mem(0), bg_capture(false), bg_buffer(64 * 1024),
+                     kill_grace(0), mem_guard(false), mem_stall_ms(200), mem_resume_secs(10),
+                     mem_psi_path(MEMGUARD_PSI_PATH), fg_boost(FGBOOST_OFF) {}
+};
+
+class Command;
+
+// Runs a command that is not an external program (a builtin, a redirection) in a
+// forked child set up by attrs. This is the only place that still has to fork.
+pid_t forkCommand(Command *cmd, const SpawnAttrs &attrs);
+
 
 class Command {
 public:
@@ -43,6 +176,12 @@ public:
     virtual ~Command() = default;
 
     virtual void execute() = 0;
+
+    // True for builtins whose only effect is what they print. Such a builtin can run
+    // inside smash as a pipeline stage instead of in a forked child.
+    virtual bool isOutputOnly() const {
+        return false;
+    }
     //virtual void prepare();
     //virtual void cleanup();
 
@@ -71,9 +210,8 @@ private:
 public:
     ChangeDirCommand(const char *cmd_line, char **plastPwd) : BuiltInCommand(cmd_line), plastPwd(plastPwd) {};
 
-    ~ChangeDirCommand() override {
-        free(*plastPwd);
-    }
+    // *plastPwd belongs to the shell, which frees it.
+    ~ChangeDirCommand() override = default;
 
     void execute() override {
         if (command_args.size() != 1) {
@@ -107,6 +245,10 @@ public:
 
     virtual ~GetCurrDirCommand() = default;
 
+    bool isOutputOnly() const override {
+        return true;
+    }
+
     void execute() override {
         char BUFFER[MAX_BUFFER_SIZE];
         if(getcwd(BUFFER, sizeof(BUFFER))!= nullptr) {
@@ -121,6 +263,10 @@ public:
 
     virtual ~ShowPidCommand() = default;
 
+    bool isOutputOnly() const override {
+        return true;
+    }
+
     void execute() override {
         int pid = getpid();
         cout << "smash pid is "<< pid << endl;
@@ -131,38 +277,430 @@ public:
 
 
 
+#define QUEUE_RETRY_MS 1000
+// How long quit kill waits for SIGKILLed jobs to be reaped.
+#define KILL_REAP_MS 1000
+// Descriptors that what smash keeps open for its jobs leaves free, so that many jobs
+// never make a redirection or a pipe of the next command fail.
+#define SPARE_FDS 64
+// How often a wait that cannot poll the capture pipes drains them anyway.
+#define CAPTURE_DRAIN_MS 100
+// memguard watches the "some" memory stall time over windows this long.
+#define MEMGUARD_WINDOW_US 2000000
+// How often a foreground wait that serves memguard or throttle looks for a stopped process.
+#define MEMGUARD_STOP_CHECK_MS 250
+// Captured outputs kept after their jobs are gone, for jobs -o.
+#define FINISHED_OUTPUTS_MAX 16
+// A throttled job runs for part of every cycle this long and is stopped for the rest.
+#define THROTTLE_PERIOD_MS 100
+// How much of what a job used in the last cycles still counts each cycle. /proc has
+// it in clock ticks, longer than the runs of a job throttled hard.
+#define THROTTLE_DECAY 0.9
+// The shortest part it runs, a job that would need less gets longer cycles instead,
+// up to THROTTLE_MAX_CYCLES periods.
+#define THROTTLE_MIN_RUN_MS 2
+#define THROTTLE_MAX_CYCLES 10
+
+// /proc/<pid>/stat and statm of a process of a job, kept open so that a sample is
+// two pread() calls. They stay bound to that process, never to a recycled pid.
+struct ProcFiles {
+    pid_t pid;
+    int stat_fd;                    // -1 where it was not kept, see SPARE_FDS
+    int statm_fd;
+    unsigned long long ticks;       // utime + stime at the last sample
+    unsigned long long sampled_ns;  // when that was, 0 - not sampled yet
+};
+
+// throttle keeps a job at a share of one CPU by stopping its process group for part
+// of every cycle. How long it runs is corrected each cycle from the CPU time its
+// processes really used, so a job with several threads or one that sleeps on its own
+// still ends up at its share.
+struct JobThrottle {
+    int percent;                    // of one CPU, 0 - not throttled
+    bool isStopped;                 // in the stopped part of the cycle, throttle sent SIGSTOP
+    unsigned long long cycle_ns;    // when the cycle started, 0 - starts at the next check
+    unsigned long long switch_ns;   // when the part of the cycle it is in ends
+    unsigned long long run_ns;      // how long it runs per cycle
+    unsigned long long ran_ns;      // how long it ran in this cycle, once stopped
+    unsigned long long period_ns;   // of the cycle
+    double cpu_secs;                // the job used by the start of the cycle
+    double used_secs;               // CPU time it used over the last cycles, each older one weighs less
+    double ran_secs;                // wall time it ran over them, weighed alike
+    double credit_secs;             // CPU time it is owed, negative when it used too much
+
+    JobThrottle() : percent(0), isStopped(false), cycle_ns(0), switch_ns(0), run_ns(0), ran_ns(0), period_ns(0),
+                    cpu_secs(0), used_secs(0), ran_secs(0), credit_secs(0) {}
+};
+
+// Wall times jobstats keeps per command name for its percentiles, the newest ones.
+#define JOB_STATS_SAMPLES 1024
+// Finished jobs jobs -v still shows.
+#define JOB_RECORDS_MAX 16
+
+// What the processes of a job used, added up as wait4() reaps them.
+struct JobUsage {
+    double wall_secs;           // from the start of the job until its last process exited
+    double user_secs;
+    double sys_secs;
+    long max_rss_kb;            // of its largest process
+    long minor_faults;
+    long major_faults;
+    long voluntary_switches;
+    long involuntary_switches;
+
+    JobUsage() : wall_secs(0), user_secs(0), sys_secs(0), max_rss_kb(0), minor_faults(0), major_faults(0),
+                 voluntary_switches(0), involuntary_switches(0) {}
+
+    void add(const struct rusage& usage);
+};
+
+// A finished job as jobs -v lists it.
+struct JobRecord {
+    int job_id;
+    string aliased_command;
+    int exit_status;
+    JobUsage usage;
+    ResourceLimits limits;
+};
+
+// The finished jobs of one command name.
+struct CommandStats {
+    size_t count;
+    vector<double> wall_secs;   // ring of the last JOB_STATS_SAMPLES
+    size_t next_sample;
+    double total_secs;
+    long peak_rss_kb;
+
+    CommandStats() : count(0), next_sample(0), total_secs(0), peak_rss_kb(0) {}
+
+    void add(const JobUsage& usage);
+
+    // Nearest-rank percentile of the kept wall times.
+    double percentile(double p) const;
+};
+
+// What a background job wrote to its stdout and stderr, read from a pipe by smash.
+// The newest bytes stay in a ring in memory, older ones are spilled to an unlinked
+// temporary file, so the whole output can be read back at any time.
+class JobOutput {
+    vector<char> ring;
+    size_t ring_start;
+    size_t ring_used;
+    int spill_fd;                   // -1 until the ring first overflows
+    unsigned long long spilled;     // bytes before the ring, in the spill file
+    unsigned long long lost;        // bytes before the spill file, they could not be written
+
+    void spill(const char *data, size_t len);
+
+    void append(const char *data, size_t len);
+
+public:
+    int fd;                         // read end of the job's pipe, -1 after end of file
+
+    JobOutput(int fd, size_t capacity);
+
+    ~JobOutput();
+
+    JobOutput(JobOutput const &) = delete;
+    void operator=(JobOutput const &) = delete;
+
+    // Reads whatever the pipe holds without blocking.
+    void drain();
+
+    unsigned long long total() const {
+        return spilled + ring_used;
+    }
+
+    // Writes the output from offset from on to out_fd, returns where it stopped.
+    unsigned long long writeTo(int out_fd, unsigned long long from) const;
+
+    // The job moved to the foreground: a child copies the rest of the pipe to the
+    // terminal, smash does not read it anymore.
+    void forward();
+};
+
+// The jobs live by value in one vector ordered by id. A removed job leaves a
+// tombstone (job_id -1) that the next addJob() compacts away once they outnumber
+// the live jobs, hash indexes by id and by pid point into the vector.
+// A JobEntry pointer stays valid until the next addJob().
 class JobsList {
 public:
     class JobEntry {
     public:
-        int job_id;
-        pid_t job_pid;
-        Command* command;
-        bool isStopped;
+        int job_id;             // -1 - removed
+        pid_t job_pid;          // leads the process group of the job, signals go to the group
+        vector<pid_t> pids;     // every process of the job that was not reaped yet
+        int leader_pidfd;       // of job_pid until it is reaped, -1 without one
+        string command_str;     // as typed
+        string aliased_command; // as printed by jobs
+        bool isStopped;         // for a queued job - held back until SIGCONT
+        bool isQueued;          // waits in the queue, no process yet, job_pid is -1
+        bool needsAdmission;    // queued by batch, starts only while the machine has room
+        bool fromQueue;         // takes one of the queue's slots while it runs
+        bool memStopped;        // stopped by memguard, which resumes it, isStopped is set too
+        pid_t status_pid;       // the process whose exit status is the job's, the last stage
+        int exit_status;        // of status_pid once it exited, 128 + signal when killed
         time_t start_time;
+        unsigned long long start_ns;    // monotonic, for the wall time
+        JobUsage usage;                 // of the processes reaped so far
+        unique_ptr<JobOutput> output;   // with setopt bgcapture on, else nullptr
+        vector<ProcFiles> proc_files;   // of the processes jobs -s sampled so far
+        ResourceLimits limits;          // its processes started with, as limit %id changed them
+        SchedSettings sched;            // likewise for sched and pin
+        JobThrottle throttle;
+
+        JobEntry(int job_id, const vector<pid_t>& pids, const Command* command, bool isStopped);
 
-        JobEntry(int job_id, pid_t job_pid, Command* command, bool isStopped)
-                : job_id(job_id), job_pid(job_pid), command(command), isStopped(isStopped) {
-            time(&start_time);
+        // A job without processes yet, command_line is run with '&' once it starts.
+        JobEntry(int job_id, const string& command_line, bool needsAdmission);
+
+        JobEntry(JobEntry&& other) noexcept;
+
+        // The processes of the job are pids from now on.
+        void attach(const vector<pid_t>& pids);
+
+        // Closes the /proc files of pid, of every process when pid is -1.
+        void closeProcFiles(pid_t pid);
+
+        ~JobEntry();
+
+        JobEntry(JobEntry const &) = delete;
+        void operator=(JobEntry const &) = delete;
+    };
+
+    // Walks the live jobs in id order.
+    class iterator {
+        vector<JobEntry>::iterator curr, end;
+
+        void skipRemoved() {
+            while (curr != end && curr->job_id == -1) ++curr;
+        }
+
+    public:
+        iterator(vector<JobEntry>::iterator curr, vector<JobEntry>::iterator end) : curr(curr), end(end) {
+            skipRemoved();
+        }
+
+        JobEntry& operator*() const {
+            return *curr;
+        }
+
+        JobEntry* operator->() const {
+            return &*curr;
+        }
+
+        iterator& operator++() {
+            ++curr;
+            skipRemoved();
+            return *this;
+        }
+
+        bool operator!=(const iterator& other) const {
+            return curr != other.curr;
         }
     };
 
 private:
-    vector<JobEntry*> jobs_list;
+    vector<JobEntry> jobs_table;
+    size_t live_num;
+    unordered_map<int, size_t> slot_by_id;
+    unordered_map<pid_t, size_t> slot_by_pid;      // every pid of a job that was not reaped yet
+    vector<int> finished_ids;                      // jobs whose pids were all reaped, still listed
+    int child_fd;                                  // signalfd of SIGCHLD, -1 - reap on every call
+    deque<int> queued_ids;                         // the queue in FIFO order, may hold removed ids
+    size_t queue_running;                          // started from the queue and not finished
+    int starting_id;                               // the queued job addJob() gives the next pids to
+    bool admission_blocked;                        // the head of the queue waits for the machine
+    pid_t shell_pid;                               // forked children never start queued jobs
+    vector<pair<int, int>> *exits_sink;            // gets (job id, exit status) of finished jobs
+    vector<int> capturing_ids;                     // jobs whose capture pipe may still be open
+    deque<pair<int, unique_ptr<JobOutput>>> finished_outputs;  // of removed jobs, oldest first
+    deque<JobRecord> finished_records;             // the last jobs that finished, oldest first
+    unordered_map<string, CommandStats> command_stats;     // of every finished job, by command name
+
+    // A job fgboost lowered and what to give back to it.
+    struct LoweredJob {
+        int job_id;
+        pid_t pgid;
+        int nice;                               // of the group, FGBOOST_NICE
+        vector<pair<pid_t, int>> policies;      // of each thread, FGBOOST_IDLE
+    };
+    vector<LoweredJob> lowered_jobs;
+    int pressure_fd;                               // the PSI file while memguard is on, else -1
+    bool pressure_polled;                          // a PSI trigger is set on it, else it is read every window
+    unsigned long long pressure_total;             // stall time in us at the last read
+    unsigned long long pressure_check_ns;          // when to read it next
+    unsigned long long pressure_ns;                // when there was pressure last, 0 - not since the last resume
+
+    size_t throttled_num;                          // jobs with a throttle percent
+
+    // Samples the processes of a running job, returns their resident size in KiB.
+    long sampleJob(JobEntry& job, unsigned long long now_ns, double *cpu_share);
+
+    // The CPU time the processes of job used so far, those reaped included.
+    double jobCpuSecs(JobEntry& job);
+
+    // The output of job job_id while its capture pipe is open, else nullptr.
+    JobOutput *openOutput(int job_id);
+
+    // Signals the process group of a started job, see signalJob().
+    int signalGroup(JobEntry *job, int sig);
+
+    void recordFinished(JobEntry& job);
+
+    void removeSlot(size_t slot);
+
+    int addWaitingEntry(const string& command_line, bool needsAdmission);
+
+    // Runs the command of a waiting entry, false when it left no process behind.
+    bool launchEntry(int jobId);
+
+    void compact();
 
 public:
-    JobsList() = default;
+    // Blocks SIGCHLD, exits of children are read from child_fd instead.
+    JobsList();
 
     ~JobsList() = default;
 
+    int getChildFd() const {
+        return child_fd;
+    }
+
+    // Reaps every child that exited since the last call, each exit updates its job
+    // in O(1). Only call it while smash waits for no child of its own. It starts no
+    // queued job, startQueued() does where no JobEntry pointer is held.
+    void reapChildren();
+
     void addJob(Command *cmd, int pid ,bool isStopped = false);
 
+    // A job of several processes, the first one leads their process group.
+    void addJob(Command *cmd, const vector<pid_t>& pids, bool isStopped = false);
+
+    // Puts command_line into the queue and returns its job id.
+    int queueJob(const string& command_line, bool needsAdmission);
+
+    // Starts queued jobs while the queue has free slots and, for batch jobs, the
+    // load average and MemAvailable allow it.
+    void startQueued();
+
+    // How long smash may wait for input before a batch job should be checked again,
+    // -1 - forever.
+    int queueRetryMs() const {
+        return admission_blocked ? QUEUE_RETRY_MS : -1;
+    }
+
+    size_t queueRunning() const {
+        return queue_running;
+    }
+
+    size_t queueWaiting() const;
+
+    // Takes a queued job out of the queue and runs it in the foreground.
+    void runQueuedInForeground(int jobId);
+
     void printJobsList();
 
-    void killAllJobs();
+    // The live jobs with their time so far, then the last finished ones with what
+    // they used.
+    void printJobsVerbose();
+
+    void printCommandStats();
+
+    // The live jobs with their elapsed time, CPU usage since the last sample (since
+    // the start for a first one) and resident memory, summed over their processes.
+    void printJobsSample();
+
+    // Signals every job at once, SIGTERM first when grace_secs > 0 and SIGKILL to
+    // those still running after it, then reaps them all and empties the list. Takes
+    // at most grace_secs plus KILL_REAP_MS.
+    void killAllJobs(double grace_secs = 0);
+
+    // Reaps until every started job finished or deadline_ns passed, false then.
+    bool reapUntil(unsigned long long deadline_ns);
+
+    // Lowers the running jobs as boost says, all but the one whose group is
+    // foreground, and remembers how they were.
+    void lowerJobs(FgBoost boost, pid_t foreground);
+
+    // Gives the jobs lowerJobs() lowered back their priority, those still listed.
+    void restoreJobs();
+
+    // Starts memguard: a PSI trigger on psi_path fires once tasks stalled on memory
+    // for stall_ms of a MEMGUARD_WINDOW_US window. Where the file takes no triggers
+    // the stall time is read every window instead. False for a file without it.
+    bool startMemGuard(const string& psi_path, int stall_ms);
+
+    // Stops memguard and resumes the jobs it stopped.
+    void stopMemGuard();
+
+    // The fd to poll for POLLPRI, -1 while nothing has to be polled.
+    int getPressureFd() const {
+        return pressure_polled ? pressure_fd : -1;
+    }
 
+    // On pressure (fired - the trigger fired) SIGSTOPs the running job with the
+    // largest RSS, one per window for as long as it lasts. After mem_resume_secs
+    // without pressure the jobs it stopped get SIGCONT.
+    void guardMemory(bool fired);
+
+    // How long a wait may block before guardMemory() has to run again, -1 - forever.
+    int memGuardRetryMs() const;
+
+    // Keeps job at percent of one CPU from now on, 0 - lets it run freely again.
+    // A queued job is throttled once it starts.
+    void throttleJob(JobEntry *job, int percent);
+
+    // Switches the throttled jobs whose part of the cycle ended between running and
+    // stopped.
+    void throttleJobs();
+
+    // How long a wait may block before throttleJobs() has to run again, -1 - forever.
+    int throttleRetryMs() const;
+
+    // Before smash exits: ends every throttle and memguard, so that no job is left
+    // stopped by them. A stopped job that outlives smash gets SIGHUP from the kernel.
+    void releaseJobs();
+
+    // Returns once pid exited or stopped, serving memguard and the throttled jobs
+    // meanwhile. At once when there is nothing to serve, the caller reaps pid.
+    void waitGuarded(pid_t pid);
+
+    // pid of a job exited with status and was reaped, using usage when known.
+    void processExited(pid_t pid, int status = 0, const struct rusage *usage = nullptr);
+
+    // Until called again with nullptr, every job that finishes adds its id and exit
+    // status to sink, before the id can be handed to another job.
+    void setExitsSink(vector<pair<int, int>> *sink) {
+        exits_sink = sink;
+    }
+
+    // Runs command_line as a background job now. Returns its id, -1 when it left no
+    // process behind: a builtin, or a command that could not start.
+    int runJob(const string& command_line);
+
+    // Drops the jobs reapChildren() found finished.
     void removeFinishedJobs();
 
+    // The job whose process is pid writes into fd from now on.
+    void captureOutput(pid_t pid, int fd, size_t capacity);
+
+    // The captured output of a job, still listed or among the last ones removed.
+    JobOutput *getOutput(int jobId);
+
+    // Adds a poll entry for every capture pipe that is still open.
+    void addOutputPolls(vector<struct pollfd>& polls);
+
+    // Reads every capture pipe that has data.
+    void drainOutputs();
+
+    bool capturing();
+
+    // Signals the process group of job. Through the pidfd of its leader while the
+    // leader is not reaped, so a recycled pid is never hit. A queued job is held by
+    // SIGSTOP and SIGTSTP, released by SIGCONT and dropped by any other signal.
+    int signalJob(JobEntry *job, int sig);
+
     JobEntry *getJobById(int jobId);
 
     void removeJobById(int jobId);
@@ -173,23 +711,45 @@ public:
 
     JobEntry *getLastStoppedJob(int *jobId);
 
-    vector<JobEntry*> getJobsList() const {
-        return jobs_list;
+    size_t size() const {
+        return live_num;
+    }
+
+    bool empty() const {
+        return live_num == 0;
+    }
+
+    iterator begin() {
+        return iterator(jobs_table.begin(), jobs_table.end());
+    }
+
+    iterator end() {
+        return iterator(jobs_table.end(), jobs_table.end());
     }
 };
 
+// jobs [-v | -s | --live [secs] | -o id | -f id]: lists the jobs, -v with what they
+// used. -s samples the CPU and memory of the running jobs, --live samples them every
+// secs (1 by default) until they are all gone. -o prints the captured output of a
+// job, -f goes on printing what the job writes until it closes its output.
 class JobsCommand : public BuiltInCommand {
     JobsList * jobs;
+
+    void printOutput(int jobId, bool follow);
+
+    void printLive(double interval_secs);
+
 public:
     JobsCommand(const char *cmd_line, JobsList *jobs): BuiltInCommand(cmd_line), jobs(jobs) {
     }
 
     virtual ~JobsCommand() = default;
 
-    void execute() override {
-        jobs->printJobsList();
-    
+    bool isOutputOnly() const override {
+        return command_args.empty() || (command_args[0] != "-f" && command_args[0] != "--live");
     }
+
+    void execute() override;
 };
 
 inline bool is_number(const string& s)
@@ -198,6 +758,41 @@ inline bool is_number(const string& s)
         s.end(), [](unsigned char c) { return !isdigit(c); }) == s.end();
 }
 
+// "4096", "64K", "1M", "2G" -> bytes. False for a size that does not fit.
+inline bool parseSize(const string& s, unsigned long long *size)
+{
+    size_t digits = 0;
+    while (digits < s.size() && isdigit((unsigned char) s[digits])) digits++;
+    if (digits == 0 || digits + 1 < s.size()) return false;
+    errno = 0;
+    unsigned long long value = strtoull(s.substr(0, digits).c_str(), nullptr, 10);
+    if (errno == ERANGE) return false;
+    int shift = 0;
+    if (digits < s.size()) {
+        switch (toupper((unsigned char) s[digits])) {
+            case 'K': shift = 10; break;
+            case 'M': shift = 20; break;
+            case 'G': shift = 30; break;
+            default: return false;
+        }
+    }
+    if (value > (ULLONG_MAX >> shift)) return false;
+    *size = value << shift;
+    return true;
+}
+
+// "0.5", "2" -> seconds. False for inf, nan or more than MAX_SECS.
+inline bool parseSecs(const string& s, double *secs)
+{
+    char *end;
+    double value = strtod(s.c_str(), &end);
+    if (s.empty() || *end != '\0' || !std::isfinite(value) || value < 0 || value > MAX_SECS) return false;
+    *secs = value;
+    return true;
+}
+
+// kill -signum target...: a target is a job id, %id or a range of ids first-last.
+// Ids a range covers that have no job are skipped.
 class KillCommand : public BuiltInCommand {
     JobsList * jobs;
 public:
@@ -205,25 +800,7 @@ public:
 
     virtual ~KillCommand() = default;
 
-    void execute() override {
-        if (command_args.size() != 2 || command_args[0][0] != '-' || !is_number(command_args[0].substr(1)) || !is_number(command_args[1])) {
-            cerr << "smash error: kill: invalid arguments" << endl;
-            return;
-        }
-        int id = stoi(command_args[1]);
-        JobsList::JobEntry* curr_job = jobs->getJobById(id);
-        if (curr_job == nullptr) {
-            cerr << "smash error: kill: job-id "<< id <<" does not exist" << endl;
-            return;
-        }
-
-        int signal = stoi(command_args[0].substr(1));
-        cout << "signal number " << signal << " was sent to pid " << curr_job->job_pid << endl;
-        if (kill(curr_job->job_pid, signal) == -1) {
-            perror("smash error: kill failed");
-            return;
-        }
-    }
+    void execute() override;
 };
 
 
@@ -234,6 +811,10 @@ public:
 
     virtual ~ListDirCommand() = default;
 
+    bool isOutputOnly() const override {
+        return true;
+    }
+
     void execute() override {
         if (command_args.size() > 1) {
             cerr << "smash error: listdir: too many arguments" << endl;
@@ -298,6 +879,10 @@ public:
 
     virtual ~GetUserCommand() = default;
 
+    bool isOutputOnly() const override {
+        return true;
+    }
+
     void execute() override {
         if (command_args.size() != 1) {
             cerr << "smash error: getuser: too many arguments" << endl;
@@ -331,6 +916,8 @@ public:
 
 static set<string> reserved_keywords = {
         "chprompt", "showpid", "pwd", "cd", "jobs", "fg", "quit", "kill", "alias", "unalias", "listdir", "getuser", "watch",
+        "hash", "which", "pipestat", "setopt", "wait", "queue", "batch", "rungraph",
+        "parallel", "jobstats", "limit", "sched", "pin", "throttle",
 };
 
 static regex regex_exp_for_name("^alias [a-zA-Z0-9_]+='[^']*'$");
@@ -345,6 +932,10 @@ public:
 
     virtual ~aliasCommand() {}
 
+    bool isOutputOnly() const override {
+        return command_args.empty();
+    }
+
     void execute() override {
         if (command_str.back() == ' ') command_str = command_str.substr(0, command_str.size()-1);
 
@@ -426,13 +1017,126 @@ public:
     }
 };
 
+// Remembers where every command name was found in PATH, names that were not found
+// included, so neither a launch nor a "not found" walks the PATH directories again.
+// An inotify watch on every PATH directory drops the names that changed there.
+class PathCache {
+public:
+    struct Entry {
+        string path;            // empty for a name that is not in PATH
+        unsigned long hits;
+    };
+
+private:
+    unordered_map<string, Entry> entries;
+    string path_env;
+    bool cacheable;             // false when PATH has relative directories
+    bool negatives_cacheable;   // false when a PATH directory can not be watched
+    int inotify_fd;
+    unsigned long hits;
+    unsigned long misses;
+
+    void rebuild();
+    void processEvents();
+    static string search(const string& path_env, const string& name);
+
+public:
+    PathCache();
+
+    ~PathCache();
+
+    PathCache(PathCache const &) = delete;
+    void operator=(PathCache const &) = delete;
+
+    // Returns the absolute path of name, or "" when it is not an executable in PATH.
+    string resolve(const string& name);
+
+    void clear();
+
+    void print() const;
+};
+
+// What smash measured about the last pipeline that was worth measuring. The numbers
+// may still be on their way from a relay of a pipeline that runs in the background.
+class PipelineReport {
+public:
+    // A negative field was not measured for this run.
+    struct Row {
+        string label;
+        long long bytes_in;
+        long long bytes_out;
+        double full_secs;        // the stage was blocked writing into a full pipe
+        double empty_secs;       // the stage was blocked reading an empty pipe
+        double cpu_secs;
+        double stalled_secs;     // the fan-out relay waited for room in this stage's pipe
+    };
+
+    // What a fan-out relay writes back for every consumer.
+    struct RawRow {
+        unsigned long long bytes;
+        unsigned long long stalled_ns;
+    };
+
+    // What the relay of a measured pipeline writes back for every pipe it moved.
+    struct RawLink {
+        unsigned long long bytes;
+        unsigned long long full_ns;
+        unsigned long long empty_ns;
+    };
+
+private:
+    // Stats a relay still has to send: count fan-out consumers from first_row on, or
+    // count pipes, the first one between stages first_row and first_row + 1.
+    struct Pending {
+        int fd;
+        size_t first_row;
+        size_t count;
+        bool links;
+    };
+
+    string command_line;
+    vector<Row> rows;
+    vector<Pending> pending;
+
+public:
+    PipelineReport() = default;
+
+    ~PipelineReport();
+
+    PipelineReport(PipelineReport const &) = delete;
+    void operator=(PipelineReport const &) = delete;
+
+    // Starts a new report with one row per label, nothing measured yet.
+    void start(const string& command_line, const vector<string>& labels);
+
+    Row& row(size_t i) {
+        return rows[i];
+    }
+
+    // A relay will write its stats to fd, links tells which relay it is.
+    void expect(size_t first_row, size_t count, int fd, bool links);
+
+    // Reads the stats of the relays, blocking only when wait is set.
+    void collect(bool wait);
+
+    void print();
+};
+
 class SmallShell {
 private:
+    PathCache path_cache;
+    PipelineReport pipeline_report;
+    ShellOptions options;
     JobsList * job_list_of_shell;
     char* lastPwd;
     map<string, string> alias_map;
     vector<string> keys;
     pid_t foreground_pid;
+    bool foreground_is_group;
+    ResourceLimits command_limits;  // of the limit prefix that runs now
+    SchedSettings command_sched;    // of the sched or pin prefix that runs now
+    string input_buffer;
+    bool input_eof;
     SmallShell();
 
 public:
@@ -452,6 +1156,17 @@ public:
 
     void executeCommand(const char *cmd_line);
 
+    // Reads the next command line, reaping children that exit while it waits.
+    // Returns false at the end of the input.
+    bool readLine(string& line);
+
+    // Forgets the input read ahead and its end: for a forked builtin whose stdin is now
+    // a pipe, and once Ctrl-D ended the lines a builtin read from the terminal.
+    void resetInput() {
+        input_buffer.clear();
+        input_eof = false;
+    }
+
     const map<string, string>& getAliasMap() const {
         return alias_map;
     }
@@ -460,13 +1175,67 @@ public:
         return job_list_of_shell;
     }
 
-    void setForegroundPid(pid_t pid) {
+    PathCache& getPathCache() {
+        return path_cache;
+    }
+
+    PipelineReport& getPipelineReport() {
+        return pipeline_report;
+    }
+
+    ShellOptions& getOptions() {
+        return options;
+    }
+
+    // The limits of the processes smash starts now: those of the limit prefix that
+    // runs, the shell-wide ones for the rest.
+    ResourceLimits spawnLimits() const {
+        return command_limits.over(options.limits);
+    }
+
+    const ResourceLimits& getCommandLimits() const {
+        return command_limits;
+    }
+
+    void setCommandLimits(const ResourceLimits& limits) {
+        command_limits = limits;
+    }
+
+    const SchedSettings& getCommandSched() const {
+        return command_sched;
+    }
+
+    void setCommandSched(const SchedSettings& sched) {
+        command_sched = sched;
+    }
+
+    // isGroup - pid leads a process group and Ctrl-C kills the whole group. With
+    // setopt fgboost the background jobs are lowered from here until pid is -1 again.
+    void setForegroundPid(pid_t pid, bool isGroup = true) {
+        if (pid != -1 && foreground_pid == -1 && options.fg_boost != FGBOOST_OFF) {
+            job_list_of_shell->lowerJobs(options.fg_boost, pid);
+        } else if (pid == -1) {
+            job_list_of_shell->restoreJobs();
+        }
         foreground_pid = pid;
+        foreground_is_group = isGroup;
     }
 
     pid_t getForegroundPid() const {
         return foreground_pid;
     }
+
+    bool isForegroundGroup() const {
+        return foreground_is_group;
+    }
+
+    // Waits until every one of pids has finished or stopped.
+    // cpu_secs, when given, gets the CPU time of every pid, -1 for one that stopped.
+    void waitForeground(const vector<pid_t>& pids, vector<double> *cpu_secs = nullptr);
+
+    // The processes cmd started become one job when cmd ran with '&', otherwise
+    // smash waits for all of them.
+    void waitOrAddJob(Command *cmd, const vector<pid_t>& pids, vector<double> *cpu_secs = nullptr);
 };
 
 class ChPromptCommand : public BuiltInCommand {
@@ -485,7 +1254,35 @@ public:
 
 };
 
+// Expands the words of one command line: brace sets first, then "*", "?" and "[...]"
+// matched path component by path component. Each directory is listed once per
+// command line, d_type saves a stat for every entry.
+class GlobExpander {
+    struct DirEntry {
+        string name;
+        unsigned char type;
+    };
+
+    unordered_map<string, vector<DirEntry>> listings;
+
+    const vector<DirEntry>& listDir(const string& dir);
+    bool isDir(const string& dir, const DirEntry& entry);
+    void expandPath(const string& prefix, const vector<string>& components, size_t index, vector<string>& out);
+
+public:
+    static bool hasWildcards(const string& word);
+
+    static vector<string> expandBraces(const string& word);
+
+    static bool match(const char *pattern, const char *name);
+
+    // Appends the expansion of word to out. A pattern that matches nothing is kept as is.
+    void expand(const string& word, vector<string>& out);
+};
+
 class ExternalCommand : public Command {
+    vector<string> expanded_words;
+
 public:
 
 
@@ -495,49 +1292,125 @@ public:
 
     virtual ~ExternalCommand() = default;
 
-    void execute() override {
-        pid_t pid = fork();
+    // Builds the argv in the parent, the strings stay owned by this command.
+    vector<char*> buildArgv(GlobExpander& globber) {
+        expanded_words.clear();
+        globber.expand(command_name, expanded_words);
+        for (const string& command_arg : command_args) {
+            globber.expand(command_arg, expanded_words);
+        }
+        vector<char*> argv;
+        for (const string& word : expanded_words) {
+            argv.push_back(const_cast<char*>(word.c_str()));
+        }
+        argv.push_back(nullptr);
+        return argv;
+    }
+
+    pid_t spawn(const SpawnAttrs& attrs, GlobExpander& globber) {
+        vector<char*> argv = buildArgv(globber);
+        string path = argv[0];
+        if (path.find('/') == string::npos) {
+            path = SmallShell::getInstance().getPathCache().resolve(path);
+            if (path.empty()) {
+                errno = ENOENT;
+                perror("smash error: execvp failed");
+                return -1;
+            }
+        }
+        SmallShell& smallShell = SmallShell::getInstance();
+        SpawnStrategy strategy = smallShell.getOptions().spawn_strategy;
+        const SpawnAttrs *spawn_attrs = &attrs;
+        SpawnAttrs adjusted;
+        ResourceLimits limits = smallShell.spawnLimits();
+        const SchedSettings& sched = smallShell.getCommandSched();
+        if (limits.set != 0 || sched.isSet()) {
+            adjusted = attrs;
+            adjusted.limits = limits.over(attrs.limits);
+            adjusted.sched = sched.over(attrs.sched);
+            spawn_attrs = &adjusted;
+        }
+        pid_t pid = spawnProcess(path.c_str(), argv.data(), *spawn_attrs, strategy);
+        if (pid == -1 && errno == ENOEXEC) {
+            // A script without #!, execvp would have run it with the shell.
+            argv[0] = const_cast<char*>(path.c_str());
+            argv.insert(argv.begin(), const_cast<char*>("sh"));
+            pid = spawnProcess("/bin/sh", argv.data(), *spawn_attrs, strategy);
+        }
+        if (pid == -1) perror("smash error: execvp failed");
+        return pid;
+    }
+
+    pid_t spawn(const SpawnAttrs& attrs) {
+        GlobExpander globber;
+        return spawn(attrs, globber);
+    }
+
+    // Spawns the command with attrs, then waits for it or makes it a job.
+    void launch(const SpawnAttrs& attrs) {
+        pid_t pid = spawn(attrs);
         if (pid == -1) {
-            perror("smash error: fork failed");
             return;
         }
-        else if (pid == 0) {
-            setpgrp();
+        SmallShell::getInstance().waitOrAddJob(this, vector<pid_t>(1, pid));
+    }
 
-            vector<const char*> argv;
-            argv.push_back(command_name.c_str());
-            for (const string& command_arg : command_args) {
-                argv.push_back(command_arg.c_str());
-            }
-            argv.push_back(nullptr);
+    // In the background with setopt bgcapture on, stdout and stderr go into a pipe
+    // that the job's JobOutput reads.
+    void execute() override;
+};
 
-            if (command_name.find('*') == string::npos && command_name.find('?') == string::npos) {
-                execvp(argv[0], const_cast<char* const*>(argv.data()));
-                perror("smash error: execvp failed");
-            } 
-            else {
-                execl("/bin/bash", "bash", "-c", command_str.c_str(), nullptr);
-                perror("smash error: execl failed");
+class HashCommand : public BuiltInCommand {
+public:
+    explicit HashCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
 
-            }
-            exit(1);
+    virtual ~HashCommand() = default;
+
+    bool isOutputOnly() const override {
+        return command_args.empty();
+    }
+
+    void execute() override {
+        PathCache& path_cache = SmallShell::getInstance().getPathCache();
+        if (command_args.empty()) {
+            path_cache.print();
+        } else if (command_args.size() == 1 && command_args[0] == "-r") {
+            path_cache.clear();
+        } else {
+            cerr << "smash error: hash: invalid arguments" << endl;
         }
-        else {
-            SmallShell& smallShell = SmallShell::getInstance();
-            if (isBackground) {
-                smallShell.getJobsList()->addJob(this, pid, false);
+    }
+};
+
+class WhichCommand : public BuiltInCommand {
+public:
+    explicit WhichCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+
+    virtual ~WhichCommand() = default;
+
+    bool isOutputOnly() const override {
+        return true;
+    }
+
+    void execute() override {
+        if (command_args.empty()) {
+            cerr << "smash error: which: not enough arguments" << endl;
+            return;
+        }
+        PathCache& path_cache = SmallShell::getInstance().getPathCache();
+        for (const string& name : command_args) {
+            // smash runs its own builtin, never a file of that name on PATH.
+            if (reserved_keywords.find(name) != reserved_keywords.end()) {
+                cout << name << ": smash builtin" << endl;
+                continue;
             }
-            else {
-                smallShell.setForegroundPid(pid);
-                int status;
-                if (waitpid(pid, &status, WUNTRACED) == -1) {
-                    perror("smash error: waitpid failed");
-                }
-                smallShell.setForegroundPid(-1);
+            string path = name.find('/') == string::npos ? path_cache.resolve(name) : name;
+            if (path.empty() || access(path.c_str(), X_OK) != 0) {
+                cerr << "smash error: which: " << name << " not found" << endl;
+                continue;
             }
+            cout << path << endl;
         }
-
-
     }
 };
 
@@ -586,76 +1459,81 @@ public:
     }
 };
 
+// Output of a builtin that runs inside smash as a pipeline stage. It is passed on
+// every time it fills up: written to the pipe of the next stage when that stage is a
+// process, which blocks smash while the reader is behind. A builtin as the next stage
+// reads no input, the output is dropped as for a reader that exited at once.
+class PipeBuffer : public streambuf {
+    vector<char> buffer;
+    int fd;                 // -1 - the next stage is a builtin
+    bool broken;            // the reader is gone, the rest is dropped
+
+    bool passOn();
+
+protected:
+    int_type overflow(int_type ch) override;
+
+    int sync() override;
+
+public:
+    PipeBuffer(int fd, size_t capacity);
+};
+
+// Runs every stage of "a | b |& c ..." together, in one process group led by the first
+// process, and waits for all of them. External programs and builtins with side effects
+// are exactly one process each. Output-only builtins of a foreground pipeline run
+// inside smash, so real pipes are only created next to processes.
+//
+// "producer |+ a |+ b" fans the output of the producer out to every consumer: a relay
+// process duplicates it into one pipe per consumer with tee(2) and splice(2), the data
+// never passes through user memory.
 class PipeCommand : public Command {
-    bool isErr;
-    string command_name_1;
-    string command_name_2;
+    vector<string> stages;
+    vector<bool> stderr_piped;     // stderr_piped[i] - "|&" between stage i and i + 1
+    size_t fanout_start;           // first consumer of "|+", stages.size() without a fan-out
+    int pipe_size;                 // "pipesize <size> a | b", -1 - the setopt value
+    bool isValid;
+
+    // The pipe size to ask for, 0 - the default.
+    int pipeSize() const;
+
+    void setPipeSize(int fd, int size, bool *reported);
+
+    pid_t forkRelay(pid_t pgid, const vector<int>& keep_fds, const vector<int>& pipe_fds);
+
 public:
     explicit PipeCommand(const char *cmd_line);
 
     virtual ~PipeCommand() = default;
 
-    void execute() override {
-        int my_pipe[2];
-        if (pipe(my_pipe) == -1) {
-            perror("smash error: pipe failed");
-            return;
-        }
-        pid_t pid1 = fork();
-        if (pid1 == -1) {
-            perror("smash error: fork failed");
-            return;
-        }
-        if (pid1 == 0) {
-            setpgrp();
-            int closed_channel;
-            if (isErr) closed_channel = 2;
-            else closed_channel = 1;
-            close(closed_channel);
-            if (dup2(my_pipe[1], closed_channel) == -1) {
-                perror("smash error: dup2 failed");
-                exit(1);
-            }
-            close(my_pipe[0]);
-            close(my_pipe[1]);
+    void execute() override;
+};
 
-            SmallShell& smallShell = SmallShell::getInstance();
-            smallShell.executeCommand(command_name_1.c_str());
-            exit(1);
+class SetOptCommand : public BuiltInCommand {
+public:
+    explicit SetOptCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
 
-        }
-        pid_t pid2 = fork();
-        if (pid2 == -1) {
-            perror("smash error: fork failed");
-            return;
-        }
+    virtual ~SetOptCommand() = default;
 
-        if (pid2 == 0) {
-            setpgrp();
-            close(0);
-            dup2(my_pipe[0], 0);
-            close(my_pipe[0]);
-            close(my_pipe[1]);
+    void execute() override;
+};
 
-            SmallShell& smallShell = SmallShell::getInstance();
-            smallShell.executeCommand(command_name_2.c_str());
-            exit(1);
+class PipeStatCommand : public BuiltInCommand {
+public:
+    explicit PipeStatCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
 
+    virtual ~PipeStatCommand() = default;
+
+    bool isOutputOnly() const override {
+        return true;
+    }
+
+    void execute() override {
+        if (!command_args.empty()) {
+            cerr << "smash error: pipestat: invalid arguments" << endl;
+            return;
         }
-        else {
-            SmallShell& smallShell = SmallShell::getInstance();
-            smallShell.setForegroundPid(pid1);
-            close(my_pipe[0]);
-            close(my_pipe[1]);
-            int status;
-            if (waitpid(pid1, &status, WUNTRACED) == -1) {
-                perror("smash error: waitpid failed");
-            }
-            if (waitpid(pid2, &status, WUNTRACED) == -1) {
-                perror("smash error: waitpid failed");
-            }
-            smallShell.setForegroundPid(-1);
-        }
+        SmallShell::getInstance().getPipelineReport().print();
     }
 };
 
@@ -668,7 +1546,7 @@ public:
     virtual ~ForegroundCommand() {}
 
     void execute() override {
-        if (command_args.empty() && jobs_list->getJobsList().empty()) {
+        if (command_args.empty() && jobs_list->empty()) {
             cerr << "smash error: fg: jobs list is empty" << endl;
             return;
         }
@@ -689,72 +1567,180 @@ public:
         } else {
             curr_job = jobs_list->getLastJob(&id);
         }
+        if (curr_job->isQueued) {
+            jobs_list->runQueuedInForeground(id);
+            return;
+        }
 
         SmallShell& smallShell = SmallShell::getInstance();
         smallShell.setForegroundPid(curr_job->job_pid);
-        cout << curr_job->command->getCommandStr() << " " << curr_job->job_pid << endl;
+        cout << curr_job->command_str << " " << curr_job->job_pid << endl;
 
-        int job_pid = curr_job->job_pid;
-        if (kill(job_pid, SIGCONT) == -1) {
+        if (jobs_list->signalJob(curr_job, SIGCONT) == -1) {
             perror("smash error: kill failed");
+            smallShell.setForegroundPid(-1);    // gives the lowered jobs their priority back
             return;
         }
 
-        if (waitpid(job_pid, NULL, WUNTRACED) == -1) {
-            perror("smash error: waitpid failed");
+        if (curr_job->output) {
+            curr_job->output->drain();
+            curr_job->output->writeTo(STDOUT_FILENO, 0);
+            curr_job->output->forward();
         }
-        jobs_list->removeJobById(job_pid);
+        vector<pid_t> pids = curr_job->pids;
+        jobs_list->removeJobById(id);
+        smallShell.waitForeground(pids);
         smallShell.setForegroundPid(-1);
     }
 };
 
+// "cmd > file", ">>", "<", "2>" and "2>>", any number of them. Builtins run in smash
+// itself with the fds swapped for the duration of the command, an external command
+// gets the files set up in the one child that is spawned for it.
 class RedirectionCommand : public Command {
 private:
-    bool isAppend;
+    struct Redirection {
+        int fd;
+        int flags;
+        string file_name;
+    };
+
+    vector<Redirection> redirections;
     string command_name_in_redir;
-    string file_name;
+
 public:
     explicit RedirectionCommand(const char *cmd_line);
 
     virtual ~RedirectionCommand() = default;
 
-    void execute() override {
-        pid_t pid = fork();
+    void execute() override;
+};
 
-        if (pid < 0) {
-            perror("smash error: fork failed");
-            return;
-        }
-        else if (pid == 0) {
+// queue [-j slots] [command]: runs command as a background job once one of the
+// queue's slots is free, jobs shows it until then. Without a command, prints the
+// state of the queue. batch [command] queues command to start only while the load
+// average and MemAvailable are within the setopt batchload/batchmem limits.
+class QueueCommand : public BuiltInCommand {
+    JobsList * jobs;
+    bool isBatch;
+public:
+    QueueCommand(const char *cmd_line, JobsList *jobs, bool isBatch)
+            : BuiltInCommand(cmd_line), jobs(jobs), isBatch(isBatch) {}
 
-            setpgrp();
-            close(STDOUT_FILENO);
-            int success;
+    virtual ~QueueCommand() = default;
 
-            if (isAppend) success = open(file_name.c_str(), O_RDWR | O_CREAT | O_APPEND, 0664);
-            else success = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0664);
-            if (success == -1) {
-                perror("smash error: open failed");
-                exit(1);
-            }
-            SmallShell& smallShell = SmallShell::getInstance();
-            smallShell.executeCommand(command_name_in_redir.c_str());
-            close(success);
-            exit(1);
-        }
-        else {
-            SmallShell& smallShell = SmallShell::getInstance();
-            smallShell.setForegroundPid(pid);
+    void execute() override;
+};
 
-            int status;
-            if (waitpid(pid, &status, WUNTRACED) == -1) {
-                perror("smash error: waitpid failed");
-            }
-            smallShell.setForegroundPid(-1);
+// rungraph [-j width] <file>: runs a graph of commands as background jobs, at most
+// width of them at once, the number of cores by default. Every line of file is
+// "name : dependencies : command". A node starts once all its dependencies finished
+// with status 0 and is skipped once one of them failed.
+class RunGraphCommand : public BuiltInCommand {
+    JobsList * jobs;
+public:
+    RunGraphCommand(const char *cmd_line, JobsList *jobs): BuiltInCommand(cmd_line), jobs(jobs) {}
+
+    virtual ~RunGraphCommand() = default;
+
+    void execute() override;
+};
+
+// parallel [-j jobs] [-k] command ::: arguments: runs command once per argument as
+// background jobs, at most jobs of them at once, the number of cores by default.
+// {} in command stands for the argument, else it is appended. Without ::: the
+// arguments are the lines of standard input. The output of every run is held until
+// it exits and then printed whole, as runs finish or, with -k, in argument order.
+class ParallelCommand : public BuiltInCommand {
+    JobsList * jobs;
+public:
+    ParallelCommand(const char *cmd_line, JobsList *jobs): BuiltInCommand(cmd_line), jobs(jobs) {}
+
+    virtual ~ParallelCommand() = default;
+
+    void execute() override;
+};
+
+// limit [-m size] [-t secs] [-n files] [-c size] command: runs command with these
+// soft limits on address space, CPU time, open files and core size, over the
+// shell-wide ones. With %id instead of a command, changes them on the running
+// processes of the job through prlimit() and prints them without options. Without
+// either, sets the shell-wide limits ("default" clears one) or prints them.
+class LimitCommand : public BuiltInCommand {
+    JobsList * jobs;
+public:
+    LimitCommand(const char *cmd_line, JobsList *jobs): BuiltInCommand(cmd_line), jobs(jobs) {}
+
+    virtual ~LimitCommand() = default;
+
+    void execute() override;
+};
+
+// sched [-c cpus] [-N node] [-n nice] [-p other|batch|idle] command: runs command
+// on the cpus of a list like "0-3,8" and of a NUMA node (on those in both when both
+// are given), with a nice value and a scheduling policy. With %id instead of a
+// command, changes them for every thread of the job's process group, and prints
+// them without options. pin cpus command is sched -c cpus command, cpus may also be
+// nodeN for the cpus of NUMA node N.
+class SchedCommand : public BuiltInCommand {
+    JobsList * jobs;
+    bool isPin;
+public:
+    SchedCommand(const char *cmd_line, JobsList *jobs, bool isPin)
+            : BuiltInCommand(cmd_line), jobs(jobs), isPin(isPin) {}
+
+    virtual ~SchedCommand() = default;
+
+    void execute() override;
+};
+
+// throttle job-id [percent | off]: keeps a job at percent (1-100) of one CPU by
+// stopping and continuing it on a timer, off lets it run freely again. Without
+// either, prints how the job is throttled.
+class ThrottleCommand : public BuiltInCommand {
+    JobsList * jobs;
+public:
+    ThrottleCommand(const char *cmd_line, JobsList *jobs): BuiltInCommand(cmd_line), jobs(jobs) {}
+
+    virtual ~ThrottleCommand() = default;
+
+    void execute() override;
+};
+
+// jobstats: per command name, how many of its jobs finished, the p50 and p95 of
+// their wall times, the total and the peak RSS.
+class JobStatsCommand : public BuiltInCommand {
+    JobsList * jobs;
+public:
+    JobStatsCommand(const char *cmd_line, JobsList *jobs): BuiltInCommand(cmd_line), jobs(jobs) {}
+
+    virtual ~JobStatsCommand() = default;
+
+    bool isOutputOnly() const override {
+        return true;
+    }
+
+    void execute() override {
+        if (!command_args.empty()) {
+            cerr << "smash error: jobstats: invalid arguments" << endl;
+            return;
         }
+        jobs->printCommandStats();
     }
 };
 
+// wait [%id...] [-t secs] [-n]: blocks until the given jobs, all jobs by default,
+// finished. -n returns once any one of them finished, -t gives up after secs.
+class WaitCommand : public BuiltInCommand {
+    JobsList * jobs;
+public:
+    WaitCommand(const char *cmd_line, JobsList *jobs): BuiltInCommand(cmd_line), jobs(jobs) {}
+
+    virtual ~WaitCommand() = default;
+
+    void execute() override;
+};
+
 class QuitCommand : public BuiltInCommand {
 public:
     JobsList * jobs;
@@ -763,13 +1749,15 @@ public:
     virtual ~QuitCommand() = default; 
     void execute() override {
         if (!command_args.empty() && command_args.at(0).compare("kill") == 0){
-            vector<JobsList::JobEntry *> jobs_list = jobs->getJobsList();
-            cout << "smash: sending SIGKILL signal to " << jobs_list.size() << " jobs:" << endl;
-            for (auto &job : jobs_list) {
-                cout << job->job_pid << ": " << job->command->aliased_command << endl;
+            bool isGraceful = SmallShell::getInstance().getOptions().kill_grace > 0;
+            cout << "smash: sending " << (isGraceful ? "SIGTERM" : "SIGKILL") << " signal to "
+                 << jobs->size() - jobs->queueWaiting() << " jobs:" << endl;
+            for (JobsList::JobEntry& job : *jobs) {
+                if (!job.isQueued) cout << job.job_pid << ": " << job.aliased_command << endl;
             }
-            jobs->killAllJobs();
+            jobs->killAllJobs(SmallShell::getInstance().getOptions().kill_grace);
         }
+        jobs->releaseJobs();
         exit(0);
     }
 };
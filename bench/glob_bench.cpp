@@ -0,0 +1,69 @@
+// Many wildcard command lines: smash's own expansion against handing the line to
+// /bin/bash -c, which is what every wildcard command used to cost.
+//
+// usage: glob_bench [invocations] [files]
+//        defaults to 200 invocations in a directory of 1000 files
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <cstdlib>
+#include "../Commands.h"
+
+using namespace std;
+
+static double elapsedUs(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+    int invocations = argc > 1 ? atoi(argv[1]) : 200;
+    int files = argc > 2 ? atoi(argv[2]) : 1000;
+
+    char dir_template[] = "/tmp/glob_bench.XXXXXX";
+    if (mkdtemp(dir_template) == nullptr || chdir(dir_template) == -1) {
+        perror("glob_bench: mkdtemp failed");
+        return 1;
+    }
+    for (int i = 0; i < files; i++) {
+        string name = "file" + to_string(i) + (i % 2 ? ".txt" : ".log");
+        close(open(name.c_str(), O_CREAT | O_WRONLY, 0644));
+    }
+
+    const char *line = "true *.txt file1?.{txt,log} [a-f]*";
+    cout << "command line: " << line << ", " << files << " files, " << invocations << " invocations" << endl;
+
+    auto start = chrono::steady_clock::now();
+    size_t words = 0;
+    for (int i = 0; i < invocations; i++) {
+        ExternalCommand cmd(line, line);
+        GlobExpander globber;
+        words += cmd.buildArgv(globber).size() - 1;
+    }
+    double expand_us = elapsedUs(start) / invocations;
+
+    SmallShell &smash = SmallShell::getInstance();
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < invocations; i++) {
+        smash.executeCommand(line);
+    }
+    double native_us = elapsedUs(start) / invocations;
+
+    char *bash_argv[] = {const_cast<char*>("bash"), const_cast<char*>("-c"), const_cast<char*>(line), nullptr};
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < invocations; i++) {
+        pid_t pid = spawnProcess("/bin/bash", bash_argv, SpawnAttrs());
+        if (pid != -1) waitpid(pid, nullptr, 0);
+    }
+    double bash_us = elapsedUs(start) / invocations;
+
+    cout << fixed << setprecision(1);
+    cout << "words per line:        " << words / invocations << endl;
+    cout << "expansion only:        " << expand_us << " us" << endl;
+    cout << "smash expand + exec:   " << native_us << " us" << endl;
+    cout << "bash -c:               " << bash_us << " us" << endl;
+
+    string cleanup = string("rm -rf ") + dir_template;
+    return system(cleanup.c_str()) == 0 ? 0 : 1;
+}
@@ -0,0 +1,82 @@
+// Adds, looks up, walks and removes many jobs in a JobsList. The jobs get pids no
+// process can have, so only the table is measured, not the processes.
+//
+// usage: jobs_bench [jobs]
+//        defaults to 100000 jobs
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <cstdlib>
+#include "../Commands.h"
+
+using namespace std;
+
+// Above PID_MAX_LIMIT, pidfd_open() refuses these without a lookup.
+#define FAKE_PID_BASE (1 << 30)
+
+static double elapsedNs(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char *what, double total_ns, size_t ops) {
+    cout << left << setw(28) << what << right << setw(10) << total_ns / ops << " ns/op" << endl;
+}
+
+static void addAll(JobsList &jobs, Command &cmd, int jobs_num) {
+    for (int i = 0; i < jobs_num; i++) {
+        jobs.addJob(&cmd, vector<pid_t>(1, FAKE_PID_BASE + i));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int jobs_num = argc > 1 ? atoi(argv[1]) : 100000;
+    ExternalCommand cmd("sleep 1000 &", "sleep 1000 &");
+    JobsList jobs;
+    mt19937 random(1);
+    vector<int> order(jobs_num);
+    for (int i = 0; i < jobs_num; i++) order[i] = i;
+    cout << jobs_num << " jobs" << endl << fixed << setprecision(1);
+
+    auto start = chrono::steady_clock::now();
+    addAll(jobs, cmd, jobs_num);
+    report("addJob", elapsedNs(start), jobs_num);
+
+    shuffle(order.begin(), order.end(), random);
+    start = chrono::steady_clock::now();
+    size_t found = 0;
+    for (int i : order) found += jobs.getJobById(i + 1) != nullptr;
+    report("getJobById", elapsedNs(start), jobs_num);
+
+    start = chrono::steady_clock::now();
+    long long id_sum = 0;
+    for (JobsList::JobEntry &job : jobs) id_sum += job.job_id;
+    report("walk in id order", elapsedNs(start), jobs_num);
+
+    // What the reaper does: one exit at a time in any order, then one sweep.
+    shuffle(order.begin(), order.end(), random);
+    start = chrono::steady_clock::now();
+    for (int i : order) jobs.processExited(FAKE_PID_BASE + i);
+    jobs.removeFinishedJobs();
+    report("processExited + sweep", elapsedNs(start), jobs_num);
+
+    // What fg does, with every removal leaving a tombstone for addJob to compact.
+    addAll(jobs, cmd, jobs_num);
+    shuffle(order.begin(), order.end(), random);
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < jobs_num / 2; i++) jobs.removeJobById(order[i] + 1);
+    report("removeJobById", elapsedNs(start), jobs_num / 2);
+
+    start = chrono::steady_clock::now();
+    addAll(jobs, cmd, jobs_num);
+    report("addJob after removals", elapsedNs(start), jobs_num);
+
+    if (found != (size_t) jobs_num || id_sum != (long long) jobs_num * (jobs_num + 1) / 2 ||
+        jobs.size() != (size_t) (jobs_num + jobs_num - jobs_num / 2)) {
+        cerr << "jobs_bench: the table lost jobs" << endl;
+        return 1;
+    }
+    return 0;
+}
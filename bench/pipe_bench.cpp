@@ -0,0 +1,86 @@
+// Throughput of a three stage pipeline run by smash at several pipe sizes, next to
+// the same pipeline run by bash. Context switches are those of the whole process
+// tree, taken from the rusage of the shell once it exits.
+//
+// usage: pipe_bench [MiB] [pipe sizes...]
+//        defaults to 512 MiB through pipes of 4K 64K 256K 1M
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <sys/resource.h>
+#include "../Commands.h"
+
+using namespace std;
+
+#ifndef SMASH_BINARY
+#define SMASH_BINARY "./skeleton_smash"
+#endif
+
+struct RunResult {
+    double secs;
+    long context_switches;
+};
+
+// Runs argv with script on its stdin and all output thrown away.
+static RunResult runShell(char *const argv[], const string& script) {
+    int script_pipe[2];
+    if (pipe2(script_pipe, O_CLOEXEC) == -1) {
+        perror("pipe_bench: pipe failed");
+        exit(1);
+    }
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    SpawnAttrs attrs;
+    attrs.dups.push_back(make_pair(script_pipe[0], STDIN_FILENO));
+    attrs.dups.push_back(make_pair(null_fd, STDOUT_FILENO));
+
+    auto start = chrono::steady_clock::now();
+    pid_t pid = spawnProcess(argv[0], argv, attrs);
+    if (pid == -1) {
+        perror("pipe_bench: spawn failed");
+        exit(1);
+    }
+    close(script_pipe[0]);
+    close(null_fd);
+    if (write(script_pipe[1], script.data(), script.size()) != (ssize_t) script.size()) {
+        perror("pipe_bench: write failed");
+    }
+    close(script_pipe[1]);
+
+    struct rusage usage;
+    wait4(pid, nullptr, 0, &usage);
+    RunResult result;
+    result.secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    result.context_switches = usage.ru_nvcsw + usage.ru_nivcsw;
+    return result;
+}
+
+static void printRow(const string& shell, const string& size, unsigned long long mib, const RunResult& result) {
+    cout << left << setw(8) << shell << setw(10) << size << right << fixed << setprecision(1)
+         << setw(10) << mib / result.secs << setw(18) << result.context_switches << endl;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long long mib = argc > 1 ? strtoull(argv[1], nullptr, 10) : 512;
+    vector<string> sizes;
+    for (int i = 2; i < argc; i++) sizes.push_back(argv[i]);
+    if (sizes.empty()) sizes = {"4K", "64K", "256K", "1M"};
+
+    string pipeline = "head -c " + to_string(mib << 20) + " /dev/zero | cat | wc -c";
+    cout << pipeline << endl;
+    cout << left << setw(8) << "shell" << setw(10) << "pipe" << right << setw(10) << "MB/s"
+         << setw(18) << "context switches" << endl;
+
+    char *smash_argv[] = {const_cast<char*>(SMASH_BINARY), nullptr};
+    for (const string& size : sizes) {
+        RunResult result = runShell(smash_argv, "setopt pipesize " + size + "\n" + pipeline + "\nquit\n");
+        printRow("smash", size, mib, result);
+    }
+
+    char *bash_argv[] = {const_cast<char*>("/bin/bash"), nullptr};
+    printRow("bash", "default", mib, runShell(bash_argv, pipeline + "\n"));
+    return 0;
+}
@@ -0,0 +1,66 @@
+// Spawn latency against the size of the spawning process' heap, for every
+// strategy of spawnProcess().
+//
+// usage: spawn_bench [iterations] [heap MiB...]
+//        defaults to 200 iterations over heaps of 0 64 256 512 MiB
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include "../Commands.h"
+
+using namespace std;
+
+static double spawnLatencyUs(SpawnStrategy strategy, int iterations, double *total_us) {
+    char *argv[] = {const_cast<char*>("true"), nullptr};
+    SpawnAttrs attrs;
+    double spawn_sum = 0, total_sum = 0;
+    for (int i = 0; i < iterations; i++) {
+        auto start = chrono::steady_clock::now();
+        pid_t pid = spawnProcess("/bin/true", argv, attrs, strategy);
+        auto spawned = chrono::steady_clock::now();
+        if (pid == -1) {
+            perror("spawn_bench: spawn failed");
+            exit(1);
+        }
+        waitpid(pid, nullptr, 0);
+        auto reaped = chrono::steady_clock::now();
+        spawn_sum += chrono::duration<double, micro>(spawned - start).count();
+        total_sum += chrono::duration<double, micro>(reaped - start).count();
+    }
+    *total_us = total_sum / iterations;
+    return spawn_sum / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    vector<size_t> heaps_mib;
+    for (int i = 2; i < argc; i++) heaps_mib.push_back(strtoul(argv[i], nullptr, 10));
+    if (heaps_mib.empty()) heaps_mib = {0, 64, 256, 512};
+
+    const SpawnStrategy strategies[] = {SPAWN_POSIX, SPAWN_VFORK, SPAWN_CLONE, SPAWN_FORK};
+    cout << left << setw(10) << "heap MiB" << setw(14) << "strategy"
+         << right << setw(14) << "spawn us" << setw(18) << "spawn+wait us" << endl;
+
+    vector<char *> heap;
+    size_t heap_mib = 0;
+    for (size_t target : heaps_mib) {
+        // Touch the memory, untouched pages cost nothing to fork.
+        for (; heap_mib < target; heap_mib++) {
+            char *chunk = (char *) malloc(1024 * 1024);
+            memset(chunk, 1, 1024 * 1024);
+            heap.push_back(chunk);
+        }
+        for (SpawnStrategy strategy : strategies) {
+            double total_us;
+            double spawn_us = spawnLatencyUs(strategy, iterations, &total_us);
+            cout << left << setw(10) << heap_mib << setw(14) << spawnStrategyName(strategy)
+                 << right << fixed << setprecision(1) << setw(14) << spawn_us << setw(18) << total_us << endl;
+        }
+    }
+    for (char *chunk : heap) free(chunk);
+    return 0;
+}
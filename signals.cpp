@@ -10,7 +10,8 @@ void ctrlCHandler(int sig_num) {
     SmallShell& smallShell = SmallShell::getInstance();
     pid_t foreground_pid = smallShell.getForegroundPid();
     if (foreground_pid != -1) {
-        if (kill(foreground_pid, SIGKILL) == -1) {
+        int res = smallShell.isForegroundGroup() ? killpg(foreground_pid, SIGKILL) : kill(foreground_pid, SIGKILL);
+        if (res == -1) {
             perror("smash error: kill failed");
         } else {
             cout << "smash: process " << foreground_pid << " was killed" << endl;
@@ -15,7 +15,9 @@ int main(int argc, char *argv[]) {
     while (true) {
         std::cout << curr_prompt << "> ";
         std::string cmd_line;
-        std::getline(std::cin, cmd_line);
+        if (!smash.readLine(cmd_line)) {
+            cmd_line = "quit";      // the end of the input quits
+        }
         smash.executeCommand(cmd_line.c_str());
     }
     return 0;
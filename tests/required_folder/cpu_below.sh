@@ -0,0 +1,12 @@
+#!/bin/bash
+
+# Reads jobs -s and tells for every running job whether its CPU usage is below $1%.
+while read -r line; do
+    cpu=$(echo "$line" | sed -n 's/.*, cpu \([0-9.]*\)%.*/\1/p')
+    [ -z "$cpu" ] && continue
+    if awk "BEGIN { exit !($cpu < $1) }"; then
+        echo "cpu below $1%"
+    else
+        echo "cpu $cpu% not below $1%"
+    fi
+done
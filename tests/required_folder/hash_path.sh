@@ -0,0 +1,5 @@
+#!/bin/bash
+
+# Runs the smash that started this script once more, with ./bin first on PATH and
+# the commands of $1.
+PATH="$(pwd)/bin:$PATH" "/proc/$PPID/exe" < "$1"
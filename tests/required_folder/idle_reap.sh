@@ -0,0 +1,18 @@
+#!/bin/bash
+
+# Runs the smash that started this script once more and gives it a background job.
+# While that smash sits at the prompt the job finishes, and this counts the zombies
+# it left behind before jobs is typed.
+mkfifo input.fifo
+"/proc/$PPID/exe" < input.fifo &
+smash=$!
+exec 3> input.fifo
+echo "sleep 0.1&" >&3
+echo "sleep 0.2 | cat &" >&3
+sleep 1
+echo "zombies: $(ps -o stat= --ppid $smash | grep -c Z)"
+echo "jobs" >&3
+echo "quit" >&3
+exec 3>&-
+wait $smash
+rm input.fifo
@@ -0,0 +1,7 @@
+#!/bin/bash
+
+# Keeps running after SIGTERM, only SIGKILL ends it. Writes term.txt when SIGTERM comes.
+trap 'echo got SIGTERM > term.txt' TERM
+while true; do
+    sleep 0.05
+done
@@ -0,0 +1,4 @@
+#!/bin/bash
+
+# Copies its input with every decimal number replaced by N, for output that holds timings.
+sed -E 's/[0-9]+\.[0-9]+/N/g'
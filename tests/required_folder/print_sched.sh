@@ -0,0 +1,6 @@
+#!/bin/bash
+
+# Prints the nice value and scheduling class of the sleep whose argument is $1,
+# a moment after the shell started this script.
+sleep 0.3
+ps -o ni=,cls=,args= -C sleep | grep "sleep $1$" | tr -s " "
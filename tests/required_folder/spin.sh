@@ -0,0 +1,4 @@
+#!/bin/bash
+
+# Keeps one CPU busy until it is killed.
+while :; do :; done